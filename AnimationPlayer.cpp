@@ -0,0 +1,192 @@
+#include "AnimationPlayer.h"
+#include <QDebug>
+#include <QImageReader>
+#include <QSettings>
+#include <algorithm>
+
+#include "Bench.h"
+#include "ParallelImage.h"
+
+AnimationPlayer::AnimationPlayer(QString filename, QObject *parent)
+    : QObject(parent)
+    , m_filename(std::move(filename))
+    , m_budget(budget()) {
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &QTimer::timeout, this, &AnimationPlayer::showNext);
+    m_clock.start();
+
+    m_thread = QThread::create([this]() { decodeLoop(); });
+    m_thread->start();
+    m_timer.start(0);
+}
+
+AnimationPlayer::~AnimationPlayer() {
+    {
+        QMutexLocker lock(&m_mutex);
+        m_quit = true;
+        m_space.wakeAll();
+    }
+    m_thread->wait();
+    delete m_thread;
+}
+
+qint64 AnimationPlayer::budget() {
+    QSettings const settings("ImgView", "ImgView");
+    return std::max<qint64>(1, settings.value("AnimationBufferMB", 256).toLongLong()) * 1024 * 1024;
+}
+
+void AnimationPlayer::setPaused(bool paused) {
+    m_paused = paused;
+    if (m_paused) {
+        m_timer.stop();
+    } else {
+        m_due = m_clock.elapsed();
+        m_timer.start(0);
+    }
+}
+
+void AnimationPlayer::seek(int frame) {
+    int const count = m_framecount;
+    frame = std::max(0, (count > 0) ? std::min(frame, count - 1) : frame);
+    {
+        QMutexLocker lock(&m_mutex);
+        m_ring.clear();
+        m_ringbytes = 0;
+        m_generation++;
+        m_seekto = frame;
+        m_space.wakeOne();
+    }
+
+    auto it = m_keyframes.upper_bound(frame);
+    if (it != m_keyframes.begin()) {
+        --it;
+        m_current = it->first;
+        emit this->frame(it->second);
+    }
+
+    // Polls until the worker delivers the target, also when paused
+    m_due = m_clock.elapsed();
+    m_timer.start(0);
+}
+
+void AnimationPlayer::decodeLoop() {
+    QImageReader reader(m_filename);
+    reader.setAutoTransform(false);
+    // GIF has to scan the whole file for this
+    m_framecount = std::max(1, reader.imageCount());
+    int next = 0;
+
+    quint64 generation = 0;
+    auto const stale = [this, &generation]() {
+        QMutexLocker lock(&m_mutex);
+        return m_quit || m_generation != generation;
+    };
+
+    for (;;) {
+        int target = -1;
+        {
+            QMutexLocker lock(&m_mutex);
+            while (!m_quit && m_seekto < 0 && !m_ring.empty() && m_ringbytes >= m_budget) {
+                m_space.wait(&m_mutex);
+            }
+            if (m_quit) {
+                return;
+            }
+            target = std::exchange(m_seekto, -1);
+            generation = m_generation;
+        }
+
+        // The handlers composite every frame onto the previous ones and cannot resume in the
+        // middle of a stream, so seeking back restarts at the first frame and seeking forward
+        // decodes the frames in between without keeping them
+        if (target >= 0) {
+            if (target < next) {
+                reader.setFileName(m_filename);
+                next = 0;
+            }
+            QImage skipped;
+            while (next < target && !stale() && reader.read(&skipped)) {
+                next++;
+            }
+            Bench::count(QStringLiteral(u"animation.seek"));
+            continue;
+        }
+
+        QImage image;
+        if (!reader.read(&image)) {
+            if (next == 0) {
+                qWarning() << "animation" << m_filename << reader.errorString();
+                return;
+            }
+            // Loop from the start
+            reader.setFileName(m_filename);
+            next = 0;
+            continue;
+        }
+
+        // Like browsers, treat delays of 10 ms and less as unset
+        int const delay = reader.nextImageDelay();
+        Frame f{ ParallelImage::displayReady(image), next++, (delay > 10) ? delay : 100 };
+
+        QMutexLocker lock(&m_mutex);
+        if (m_generation == generation) {
+            m_ringbytes += f.image.sizeInBytes();
+            m_ring.push_back(std::move(f));
+        }
+    }
+}
+
+void AnimationPlayer::showNext() {
+    Frame f;
+    {
+        QMutexLocker lock(&m_mutex);
+        if (m_ring.empty()) {
+            lock.unlock();
+            Bench::count(QStringLiteral(u"animation.underrun"));
+            int const constexpr poll_ms = 5;
+            m_timer.start(poll_ms);
+            return;
+        }
+        f = std::move(m_ring.front());
+        m_ring.pop_front();
+        m_ringbytes -= f.image.sizeInBytes();
+        m_space.wakeOne();
+    }
+
+    qint64 const now = m_clock.elapsed();
+    Bench::record(QStringLiteral(u"animation.late"), std::max<qint64>(0, now - m_due) * 1000 * 1000);
+
+    m_current = f.index;
+    if (f.index % m_keyframespacing == 0) {
+        storeKeyframe(f.index, f.image);
+    }
+    emit frame(std::move(f.image));
+
+    if (m_paused) {
+        return;
+    }
+    // Frames are never dropped; after a stall the schedule continues from now
+    m_due = std::max(m_due, now) + f.delay;
+    m_timer.start(int(std::max<qint64>(0, m_due - m_clock.elapsed())));
+}
+
+void AnimationPlayer::storeKeyframe(int index, QImage const &image) {
+    if (m_keyframes.count(index)) {
+        return;
+    }
+    m_keyframes.emplace(index, image);
+    m_keyframebytes += image.sizeInBytes();
+
+    // Over budget: double the spacing and drop the snapshots that no longer fall on it
+    while (m_keyframebytes > m_budget / 4 && m_keyframes.size() > 1) {
+        m_keyframespacing *= 2;
+        for (auto it = m_keyframes.begin(); it != m_keyframes.end();) {
+            if (it->first % m_keyframespacing) {
+                m_keyframebytes -= it->second.sizeInBytes();
+                it = m_keyframes.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <QElapsedTimer>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QThread>
+#include <QTimer>
+#include <QWaitCondition>
+#include <atomic>
+#include <deque>
+#include <map>
+
+// Plays an animated GIF or WebP without holding all of its frames. A worker thread decodes
+// ahead into a ring bounded by a byte budget, the GUI thread takes frames out when the delay
+// of the previous frame has passed. Every few frames a snapshot goes into a keyframe index
+// that is kept within a quarter of the budget, so a seek shows the nearest earlier frame
+// right away while the worker decodes up to the target.
+class AnimationPlayer : public QObject {
+    Q_OBJECT
+public:
+    AnimationPlayer(QString filename, QObject *parent = nullptr);
+    ~AnimationPlayer();
+
+    // Bytes of decoded frames kept ahead, settings key "AnimationBufferMB"
+    static qint64 budget();
+
+    // 0 until the worker has opened the file
+    int frameCount() const { return m_framecount; }
+    int currentFrame() const { return m_current; }
+    bool isPaused() const { return m_paused; }
+    void setPaused(bool paused);
+    void seek(int frame);
+
+signals:
+    void frame(QImage image);
+
+private:
+    struct Frame {
+        QImage image;
+        int index = 0;
+        int delay = 0;
+    };
+
+    void decodeLoop();
+    void showNext();
+    void storeKeyframe(int index, QImage const &image);
+
+    QString m_filename;
+    qint64 m_budget;
+    std::atomic<int> m_framecount = 0;
+    QThread *m_thread = nullptr;
+
+    // GUI thread
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+    qint64 m_due = 0;
+    int m_current = -1;
+    bool m_paused = false;
+    std::map<int, QImage> m_keyframes;
+    qint64 m_keyframebytes = 0;
+    int m_keyframespacing = 16;
+
+    // Shared with the worker, guarded by m_mutex
+    QMutex m_mutex;
+    QWaitCondition m_space;
+    std::deque<Frame> m_ring;
+    qint64 m_ringbytes = 0;
+    quint64 m_generation = 0;
+    int m_seekto = -1;
+    bool m_quit = false;
+};
@@ -0,0 +1,415 @@
+#include "ArchiveIndex.h"
+#include <QDebug>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QtEndian>
+#include <algorithm>
+#include <limits>
+
+#ifdef IMGVIEW_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace {
+// Indexes kept in memory, one per archive
+qsizetype const constexpr maxcached = 64;
+// Deflate cannot expand more than about 1032:1
+qint64 const constexpr maxinflateratio = 1032;
+// GNU long names and pax headers are a few hundred bytes
+qint64 const constexpr maxtarheader = 1024 * 1024;
+// Largest member read into memory. Encoded images are far smaller than their pixels, this
+// is more than any image the reader's allocation limit lets through.
+qint64 const constexpr maxmembersize = 512 * 1024 * 1024;
+// First guess of the inflated size, the buffer grows from there
+qint64 const constexpr mininflatebuffer = 64 * 1024;
+
+quint16 le16(char const *p) {
+    return qFromLittleEndian<quint16>(p);
+}
+quint32 le32(char const *p) {
+    return qFromLittleEndian<quint32>(p);
+}
+quint64 le64(char const *p) {
+    return qFromLittleEndian<quint64>(p);
+}
+
+// Octal, or base-256 for large values when the high bit of the first byte is set
+qint64 tarNumber(char const *p, int length) {
+    qint64 value = 0;
+    if (uchar(p[0]) & 0x80) {
+        value = uchar(p[0]) & 0x7f;
+        for (int i = 1; i < length; ++i) {
+            value = (value << 8) | uchar(p[i]);
+        }
+        return value;
+    }
+    for (int i = 0; i < length && p[i]; ++i) {
+        if (p[i] >= '0' && p[i] <= '7') {
+            value = (value << 3) | (p[i] - '0');
+        }
+    }
+    return value;
+}
+
+QString tarString(char const *p, int length) {
+    return QString::fromUtf8(p, qstrnlen(p, length));
+}
+
+bool inflateMember(QByteArray const &packed, qint64 size, QByteArray &data, QString &error) {
+#ifdef IMGVIEW_HAVE_ZLIB
+    if (size > std::numeric_limits<uInt>::max() || packed.size() > std::numeric_limits<uInt>::max()) {
+        error = QStringLiteral(u"Member too large");
+        return false;
+    }
+    z_stream zs{};
+    // Negative window bits: raw deflate data without zlib header, as stored in ZIP
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        error = QStringLiteral(u"inflateInit failed");
+        return false;
+    }
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(packed.constData()));
+    zs.avail_in = uInt(packed.size());
+    // The size comes from the archive header, the buffer only grows as far as the data
+    // actually inflates, and never past that size
+    data.resize(qsizetype(std::min(size, std::max(mininflatebuffer, qint64(packed.size()) * 4))));
+    int result = Z_OK;
+    while (result == Z_OK) {
+        if (qint64(zs.total_out) == data.size()) {
+            if (data.size() >= size) {
+                break;
+            }
+            data.resize(qsizetype(std::min(size, qint64(data.size()) * 2)));
+        }
+        zs.next_out = reinterpret_cast<Bytef *>(data.data()) + zs.total_out;
+        zs.avail_out = uInt(data.size() - qint64(zs.total_out));
+        result = inflate(&zs, Z_NO_FLUSH);
+    }
+    inflateEnd(&zs);
+    if (result != Z_STREAM_END || zs.total_out != uLong(size)) {
+        error = QStringLiteral(u"Corrupt deflate data");
+        data.clear();
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(packed);
+    Q_UNUSED(size);
+    Q_UNUSED(data);
+    error = QStringLiteral(u"Deflated archive members need a build with zlib");
+    return false;
+#endif
+}
+}
+
+QStringList const &ArchiveIndex::extensions() {
+    static QStringList const extensions{ QStringLiteral(u"zip"), QStringLiteral(u"cbz"), QStringLiteral(u"tar"), QStringLiteral(u"cbt") };
+    return extensions;
+}
+
+bool ArchiveIndex::isArchive(QFileInfo const &fi) {
+    return extensions().contains(fi.suffix().toLower());
+}
+
+bool ArchiveIndex::split(QString const &path, QString &archive, QString &member) {
+    // Only components with an archive suffix cost a stat, plain paths are string checks
+    for (qsizetype slash = path.indexOf('/', 1); slash > 0; slash = path.indexOf('/', slash + 1)) {
+        QString const prefix = path.left(slash);
+        qsizetype const dot = prefix.lastIndexOf('.');
+        if (dot > prefix.lastIndexOf('/') && extensions().contains(prefix.mid(dot + 1).toLower()) && QFileInfo(prefix).isFile()) {
+            archive = prefix;
+            member = path.mid(slash + 1);
+            return !member.isEmpty();
+        }
+    }
+    return false;
+}
+
+std::shared_ptr<ArchiveIndex const> ArchiveIndex::open(QString const &archive) {
+    static QMutex mutex;
+    static QHash<QString, std::shared_ptr<ArchiveIndex const>> cache;
+
+    QFileInfo const fi(archive);
+    QMutexLocker lock(&mutex);
+    auto const it = cache.constFind(archive);
+    if (it != cache.cend() && it.value()->m_size == fi.size() && it.value()->m_mtime == fi.lastModified()) {
+        return it.value();
+    }
+    lock.unlock();
+
+    std::shared_ptr<ArchiveIndex> index(new ArchiveIndex);
+    index->m_path = archive;
+    index->m_size = fi.size();
+    index->m_mtime = fi.lastModified();
+    QFile file(archive);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "archive" << archive << file.errorString();
+        return nullptr;
+    }
+    index->m_zip = index->parseZip(file);
+    if (!index->m_zip && !index->parseTar(file)) {
+        qWarning() << "archive" << archive << "is neither ZIP nor TAR";
+        return nullptr;
+    }
+
+    lock.relock();
+    if (cache.size() >= maxcached) {
+        cache.erase(cache.begin());
+    }
+    cache.insert(archive, index);
+    return index;
+}
+
+bool ArchiveIndex::read(QString const &archive, QString const &member, QByteArray &data, QString &error) {
+    auto const index = open(archive);
+    Entry const *entry = index ? index->find(member) : nullptr;
+    if (!entry) {
+        error = QStringLiteral(u"'%1' not found in '%2'").arg(member, archive);
+        return false;
+    }
+    return index->read(*entry, data, error);
+}
+
+ArchiveIndex::Entry const *ArchiveIndex::find(QString const &member) const {
+    auto const it = m_byname.constFind(member);
+    return (it != m_byname.cend()) ? &m_entries[it.value()] : nullptr;
+}
+
+bool ArchiveIndex::read(Entry const &entry, QByteArray &data, QString &error) const {
+    // Every reader opens the archive itself, so members are read in parallel
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = file.errorString();
+        return false;
+    }
+    qint64 offset = entry.offset;
+    if (m_zip) {
+        // The local header repeats name and extra field, with lengths of its own
+        file.seek(entry.offset);
+        QByteArray const header = file.read(30);
+        if (header.size() != 30 || le32(header.constData()) != 0x04034b50) {
+            error = QStringLiteral(u"Corrupt local header");
+            return false;
+        }
+        offset += 30 + le16(header.constData() + 26) + le16(header.constData() + 28);
+    }
+    // Sizes come from the archive itself, check them before anything is allocated
+    qint64 const archivesize = file.size();
+    if (entry.offset < 0 || entry.packedsize < 0 || offset > archivesize || entry.packedsize > archivesize - offset) {
+        error = QStringLiteral(u"Member extends past the end of the archive");
+        return false;
+    }
+    qint64 const size = (entry.method == 0) ? entry.packedsize : entry.size;
+    if (size < 0 || size > maxmembersize || (entry.method == 8 && size / maxinflateratio > entry.packedsize)) {
+        error = QStringLiteral(u"Implausible member size %1").arg(size);
+        return false;
+    }
+    file.seek(offset);
+    QByteArray packed = file.read(entry.packedsize);
+    if (packed.size() != entry.packedsize) {
+        error = QStringLiteral(u"Truncated member");
+        return false;
+    }
+
+    if (entry.method == 0) {
+        data = std::move(packed);
+        return true;
+    }
+    if (entry.method == 8) {
+        return inflateMember(packed, entry.size, data, error);
+    }
+    error = QStringLiteral(u"Unsupported compression method %1").arg(entry.method);
+    return false;
+}
+
+void ArchiveIndex::addEntry(Entry entry) {
+    entry.name.replace('\\', '/');
+    if (entry.name.startsWith(QStringLiteral(u"./"))) {
+        entry.name.remove(0, 2);
+    }
+    if (entry.name.isEmpty() || entry.name.endsWith('/')) {
+        return;
+    }
+    m_byname.insert(entry.name, m_entries.size());
+    m_entries.push_back(std::move(entry));
+}
+
+bool ArchiveIndex::parseZip(QFile &file) {
+    // The end of central directory record is followed by a comment of up to 64 KB
+    qint64 const size = file.size();
+    qint64 const tailsize = std::min<qint64>(size, 22 + 0xffff);
+    file.seek(size - tailsize);
+    QByteArray const tail = file.read(tailsize);
+    qsizetype eocd = tail.size() - 22;
+    while (eocd >= 0 && le32(tail.constData() + eocd) != 0x06054b50) {
+        eocd--;
+    }
+    if (eocd < 0) {
+        return false;
+    }
+
+    char const *p = tail.constData() + eocd;
+    quint64 count = le16(p + 10);
+    quint64 cdsize = le32(p + 12);
+    quint64 cdoffset = le32(p + 16);
+    if (count == 0xffff || cdsize == 0xffffffff || cdoffset == 0xffffffff) {
+        // ZIP64: a locator right before the record points to the ZIP64 end record
+        file.seek(size - tailsize + eocd - 20);
+        QByteArray const locator = file.read(20);
+        if (locator.size() != 20 || le32(locator.constData()) != 0x07064b50) {
+            return false;
+        }
+        file.seek(qint64(le64(locator.constData() + 8)));
+        QByteArray const record = file.read(56);
+        if (record.size() != 56 || le32(record.constData()) != 0x06064b50) {
+            return false;
+        }
+        count = le64(record.constData() + 32);
+        cdsize = le64(record.constData() + 40);
+        cdoffset = le64(record.constData() + 48);
+    }
+
+    if (cdoffset > quint64(size) || cdsize > quint64(size) - cdoffset) {
+        return false;
+    }
+    file.seek(qint64(cdoffset));
+    QByteArray const cd = file.read(qint64(cdsize));
+    if (quint64(cd.size()) != cdsize) {
+        return false;
+    }
+
+    m_entries.reserve(qsizetype(std::min<quint64>(count, 1024 * 1024)));
+    qsizetype pos = 0;
+    while (pos + 46 <= cd.size() && le32(cd.constData() + pos) == 0x02014b50) {
+        char const *h = cd.constData() + pos;
+        quint16 const flags = le16(h + 8);
+        quint16 const namelength = le16(h + 28);
+        quint16 const extralength = le16(h + 30);
+        quint16 const commentlength = le16(h + 32);
+        if (pos + 46 + namelength + extralength > cd.size()) {
+            break;
+        }
+
+        Entry entry;
+        entry.method = le16(h + 10);
+        entry.packedsize = le32(h + 20);
+        entry.size = le32(h + 24);
+        entry.offset = le32(h + 42);
+        // Bit 11: UTF-8 names, otherwise code page 437 which is ASCII for the usual names
+        entry.name = (flags & 0x800) ? QString::fromUtf8(h + 46, namelength) : QString::fromLatin1(h + 46, namelength);
+
+        // ZIP64 extra field: 64 bit values for the fields that are saturated above
+        char const *extra = h + 46 + namelength;
+        for (qsizetype e = 0; e + 4 <= extralength;) {
+            quint16 const id = le16(extra + e);
+            quint16 const length = le16(extra + e + 2);
+            if (id == 0x0001) {
+                char const *v = extra + e + 4;
+                char const *end = v + std::min<qsizetype>(length, extralength - e - 4);
+                if (entry.size == 0xffffffff && v + 8 <= end) {
+                    entry.size = qint64(le64(v));
+                    v += 8;
+                }
+                if (entry.packedsize == 0xffffffff && v + 8 <= end) {
+                    entry.packedsize = qint64(le64(v));
+                    v += 8;
+                }
+                if (entry.offset == 0xffffffff && v + 8 <= end) {
+                    entry.offset = qint64(le64(v));
+                }
+            }
+            e += 4 + length;
+        }
+
+        // Encrypted members cannot be shown
+        if (!(flags & 0x1)) {
+            addEntry(std::move(entry));
+        }
+        pos += 46 + namelength + extralength + commentlength;
+    }
+    return true;
+}
+
+bool ArchiveIndex::parseTar(QFile &file) {
+    qint64 const size = file.size();
+    QString longname;
+    qint64 paxsize = -1;
+    qint64 pos = 0;
+    while (pos + 512 <= size) {
+        file.seek(pos);
+        QByteArray const header = file.read(512);
+        if (header.size() != 512 || header.count('\0') == 512) {
+            break;
+        }
+        char const *h = header.constData();
+
+        // The checksum is the byte sum with the checksum field taken as spaces
+        qint64 sum = 8 * ' ';
+        for (int i = 0; i < 512; ++i) {
+            sum += (i >= 148 && i < 156) ? 0 : uchar(h[i]);
+        }
+        if (sum != tarNumber(h + 148, 8)) {
+            return !m_entries.isEmpty();
+        }
+
+        qint64 const datasize = tarNumber(h + 124, 12);
+        qint64 const data = pos + 512;
+        if (datasize < 0 || datasize > size - data) {
+            return !m_entries.isEmpty();
+        }
+        pos = data + (datasize + 511) / 512 * 512;
+        char const type = h[156];
+
+        if ((type == 'L' || type == 'x') && datasize > maxtarheader) {
+            return !m_entries.isEmpty();
+        }
+        if (type == 'L') {
+            // GNU long name for the next member
+            file.seek(data);
+            QByteArray const name = file.read(datasize);
+            longname = QString::fromUtf8(name.constData(), qstrnlen(name.constData(), name.size()));
+            continue;
+        }
+        if (type == 'x') {
+            // pax extended header: "<length> <key>=<value>\n" records
+            file.seek(data);
+            QByteArray const records = file.read(datasize);
+            for (QByteArray const &record : records.split('\n')) {
+                qsizetype const space = record.indexOf(' ');
+                qsizetype const equals = record.indexOf('=');
+                if (space < 0 || equals < space) {
+                    continue;
+                }
+                QByteArray const key = record.mid(space + 1, equals - space - 1);
+                if (key == "path") {
+                    longname = QString::fromUtf8(record.mid(equals + 1));
+                } else if (key == "size") {
+                    paxsize = record.mid(equals + 1).toLongLong();
+                }
+            }
+            continue;
+        }
+
+        if (type == '0' || type == '\0') {
+            if (paxsize > size - data) {
+                return !m_entries.isEmpty();
+            }
+            Entry entry;
+            entry.offset = data;
+            entry.size = entry.packedsize = (paxsize >= 0) ? paxsize : datasize;
+            if (!longname.isEmpty()) {
+                entry.name = longname;
+            } else {
+                QString const prefix = (header.mid(257, 5) == "ustar") ? tarString(h + 345, 155) : QString();
+                entry.name = prefix.isEmpty() ? tarString(h, 100) : prefix + '/' + tarString(h, 100);
+            }
+            if (paxsize >= 0) {
+                pos = data + (paxsize + 511) / 512 * 512;
+            }
+            addEntry(std::move(entry));
+        }
+        longname.clear();
+        paxsize = -1;
+    }
+    return !m_entries.isEmpty();
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <QByteArray>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <memory>
+
+class QFile;
+
+// Member index of a ZIP/CBZ or uncompressed TAR/CBT archive, built from the ZIP central
+// directory or the TAR headers without extracting anything. Members are addressed with
+// virtual paths like "/scans/batch.zip/sub/page1.jpg" and read with random access, so
+// several loader threads can read members of the same archive at once.
+// Deflated ZIP members need zlib (IMGVIEW_HAVE_ZLIB), stored ones and TAR always work.
+class ArchiveIndex {
+public:
+    struct Entry {
+        QString name;
+        qint64 offset = 0; // ZIP: local header, TAR: member data
+        qint64 packedsize = 0;
+        qint64 size = 0;
+        quint16 method = 0; // 0 stored, 8 deflated
+    };
+
+    static QStringList const &extensions();
+    static bool isArchive(QFileInfo const &fi);
+
+    // Splits a virtual path into the archive file and the member name inside it
+    static bool split(QString const &path, QString &archive, QString &member);
+
+    // Index of the archive, cached while the archive's size and mtime stay the same
+    static std::shared_ptr<ArchiveIndex const> open(QString const &archive);
+
+    static bool read(QString const &archive, QString const &member, QByteArray &data, QString &error);
+
+    QList<Entry> const &entries() const { return m_entries; }
+    Entry const *find(QString const &member) const;
+    bool read(Entry const &entry, QByteArray &data, QString &error) const;
+
+private:
+    ArchiveIndex() = default;
+    bool parseZip(QFile &file);
+    bool parseTar(QFile &file);
+    void addEntry(Entry entry);
+
+    QString m_path;
+    qint64 m_size = 0;
+    QDateTime m_mtime;
+    bool m_zip = false;
+    QList<Entry> m_entries;
+    QHash<QString, qsizetype> m_byname;
+};
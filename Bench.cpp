@@ -0,0 +1,96 @@
+#include "Bench.h"
+#include <QDebug>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+#include <algorithm>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+namespace {
+// Enough samples for stable percentiles without growing forever
+qsizetype const constexpr maxsamples = 100000;
+
+struct Timer {
+    QList<qint64> samples;
+    qint64 count = 0;
+    qint64 total = 0;
+    qint64 max = 0;
+};
+
+QMutex mutex;
+QMap<QString, Timer> timers;
+QMap<QString, qint64> counters;
+QElapsedTimer startup;
+}
+
+bool Bench::enabled() {
+    static bool const enabled = qEnvironmentVariableIsSet("IMGVIEW_BENCH");
+    return enabled;
+}
+
+void Bench::record(QString const &name, qint64 nsecs) {
+    if (!enabled()) {
+        return;
+    }
+    QMutexLocker lock(&mutex);
+    Timer &t = timers[name];
+    t.count++;
+    t.total += nsecs;
+    t.max = std::max(t.max, nsecs);
+    if (t.samples.size() < maxsamples) {
+        t.samples.push_back(nsecs);
+    }
+}
+
+void Bench::count(QString const &name, qint64 n) {
+    if (!enabled()) {
+        return;
+    }
+    QMutexLocker lock(&mutex);
+    counters[name] += n;
+}
+
+void Bench::start() {
+    startup.start();
+}
+
+void Bench::mark(QString const &name) {
+    if (startup.isValid()) {
+        record(name, startup.nsecsElapsed());
+    }
+}
+
+void Bench::report() {
+    if (!enabled()) {
+        return;
+    }
+    QMutexLocker lock(&mutex);
+    for (auto it = timers.begin(); it != timers.end(); ++it) {
+        Timer &t = it.value();
+        std::sort(t.samples.begin(), t.samples.end());
+        auto const percentile = [&t](double p) { return t.samples.isEmpty() ? 0 : t.samples[qsizetype((t.samples.size() - 1) * p)]; };
+        qInfo().noquote() << QStringLiteral(u"%1: n=%2 mean=%3us p50=%4us p90=%5us p99=%6us max=%7us")
+                                 .arg(it.key())
+                                 .arg(t.count)
+                                 .arg(t.total / std::max<qint64>(1, t.count) / 1000)
+                                 .arg(percentile(0.5) / 1000)
+                                 .arg(percentile(0.9) / 1000)
+                                 .arg(percentile(0.99) / 1000)
+                                 .arg(t.max / 1000);
+    }
+    for (auto it = counters.cbegin(); it != counters.cend(); ++it) {
+        qInfo().noquote() << QStringLiteral(u"%1: %2").arg(it.key()).arg(it.value());
+    }
+#ifdef Q_OS_UNIX
+    // Page faults of the whole run, mostly from touching freshly mapped image buffers
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        qInfo().noquote() << QStringLiteral(u"process.faults: minor=%1 major=%2").arg(usage.ru_minflt).arg(usage.ru_majflt);
+    }
+#endif
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <QElapsedTimer>
+#include <QString>
+
+// Timing and event counters for benchmarks. Everything is a no-op unless the environment
+// variable IMGVIEW_BENCH is set; report() prints count, mean, p50, p90, p99 and max per timer.
+class Bench {
+public:
+    static bool enabled();
+    static void record(QString const &name, qint64 nsecs);
+    static void count(QString const &name, qint64 n = 1);
+    static void report();
+
+    // Startup marks: start() is called first thing in main(), mark() records the time
+    // elapsed since then under name
+    static void start();
+    static void mark(QString const &name);
+
+    // Records the lifetime of the scope under name
+    class Scope {
+    public:
+        explicit Scope(QString name)
+            : m_name(std::move(name)) {
+            if (enabled()) {
+                m_timer.start();
+            }
+        }
+        ~Scope() {
+            if (m_timer.isValid()) {
+                record(m_name, m_timer.nsecsElapsed());
+            }
+        }
+
+    private:
+        QString m_name;
+        QElapsedTimer m_timer;
+    };
+};
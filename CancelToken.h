@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <memory>
+
+// Cooperative cancellation by generation. A CancelSource hands out tokens tagged with its
+// current generation, cancel() starts the next generation and so cancels every token handed
+// out before. Work checks its token between stages and inside long loops and just stops,
+// nothing has to be tracked or joined. A default constructed token is never cancelled.
+// A token can have a parent token from another source and is then cancelled by either.
+class CancelToken {
+public:
+    CancelToken() = default;
+
+    bool isCancelled() const {
+        return (m_generation && m_generation->load(std::memory_order_relaxed) != m_tag) || (m_parent && m_parent->isCancelled());
+    }
+
+private:
+    friend class CancelSource;
+    CancelToken(std::shared_ptr<std::atomic<int> const> generation, int tag, std::shared_ptr<CancelToken const> parent = nullptr)
+        : m_generation(std::move(generation))
+        , m_tag(tag)
+        , m_parent(std::move(parent)) {}
+
+    std::shared_ptr<std::atomic<int> const> m_generation;
+    int m_tag = 0;
+    std::shared_ptr<CancelToken const> m_parent;
+};
+
+class CancelSource {
+public:
+    CancelToken token() const { return CancelToken(m_generation, m_generation->load(std::memory_order_relaxed)); }
+    // Cancelled by this source or by whatever cancels parent
+    CancelToken token(CancelToken parent) const {
+        if (!parent.m_generation && !parent.m_parent) {
+            return token();
+        }
+        return CancelToken(m_generation, m_generation->load(std::memory_order_relaxed), std::make_shared<CancelToken const>(std::move(parent)));
+    }
+    void cancel() { m_generation->fetch_add(1, std::memory_order_relaxed); }
+
+private:
+    std::shared_ptr<std::atomic<int>> m_generation = std::make_shared<std::atomic<int>>(0);
+};
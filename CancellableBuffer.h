@@ -0,0 +1,28 @@
+#pragma once
+#include <QBuffer>
+
+#include "CancelToken.h"
+
+// A read-only buffer whose reads fail once its token is cancelled. Image handlers that read
+// as they decode (JPEG, PNG, TIFF) give up at their next read instead of finishing the image;
+// handlers that read the whole file first (WebP) still decode to the end.
+class CancellableBuffer : public QBuffer {
+public:
+    CancellableBuffer(QByteArray const &data, CancelToken cancel)
+        : m_cancel(std::move(cancel)) {
+        setData(data);
+        open(QIODevice::ReadOnly);
+    }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override {
+        if (m_cancel.isCancelled()) {
+            setErrorString(QStringLiteral(u"Cancelled"));
+            return -1;
+        }
+        return QBuffer::readData(data, maxlen);
+    }
+
+private:
+    CancelToken m_cancel;
+};
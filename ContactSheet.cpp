@@ -0,0 +1,547 @@
+#include "ContactSheet.h"
+#include <QDebug>
+#include <QFileInfo>
+#include <QPainter>
+#include <QSaveFile>
+#include <QtEndian>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <vector>
+
+#ifdef IMGVIEW_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "ImageCatalog.h"
+#include "ImageHashStore.h"
+#include "ImageLoaderTask.h"
+#include "ImageMetadata.h"
+#include "ImagePipeline.h"
+
+// Streams RGB888 bands of a fixed width into a file, top to bottom. A band comes as tiles
+// side by side, all of the same height.
+class SheetEncoder {
+public:
+    explicit SheetEncoder(QString const &filename)
+        : m_file(filename) {}
+    virtual ~SheetEncoder() = default;
+
+    static std::unique_ptr<SheetEncoder> create(QString const &filename);
+
+    virtual bool begin(QSize size) = 0;
+    virtual bool write(QList<QImage> const &tiles) = 0;
+    virtual bool finish() = 0;
+    QString errorString() const { return m_error.isEmpty() ? m_file.errorString() : m_error; }
+
+protected:
+    // Row y of the band, the scanlines of the tiles one after another
+    static void scanLine(QList<QImage> const &tiles, int y, char *out) {
+        for (auto const &tile : tiles) {
+            size_t const n = size_t(tile.width()) * 3;
+            std::memcpy(out, tile.constScanLine(y), n);
+            out += n;
+        }
+    }
+
+    bool put(QByteArray const &data) { return m_file.write(data) == data.size(); }
+    bool put(char const *data, qint64 size) { return m_file.write(data, size) == size; }
+
+    QSaveFile m_file;
+    QString m_error;
+    QSize m_size;
+};
+
+namespace {
+void append16(QByteArray &out, quint16 v) {
+    v = qToLittleEndian(v);
+    out.append(reinterpret_cast<char const *>(&v), sizeof(v));
+}
+
+void append32(QByteArray &out, quint32 v) {
+    v = qToLittleEndian(v);
+    out.append(reinterpret_cast<char const *>(&v), sizeof(v));
+}
+
+void append32be(QByteArray &out, quint32 v) {
+    v = qToBigEndian(v);
+    out.append(reinterpret_cast<char const *>(&v), sizeof(v));
+}
+
+// Uncompressed baseline TIFF with one strip per band. Strip offsets and the directory go
+// after the pixels, the header is patched at the end.
+class TiffEncoder : public SheetEncoder {
+public:
+    using SheetEncoder::SheetEncoder;
+
+    bool begin(QSize size) override {
+        m_size = size;
+        // Classic TIFF has 32 bit offsets
+        if (qint64(size.width()) * size.height() * 3 > 0xffff0000LL) {
+            m_error = QStringLiteral(u"Too large for TIFF, export as PNG");
+            return false;
+        }
+        if (!m_file.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        QByteArray header("II");
+        append16(header, 42);
+        append32(header, 0);
+        return put(header);
+    }
+
+    bool write(QList<QImage> const &tiles) override {
+        int const height = tiles.front().height();
+        QByteArray row(qsizetype(m_size.width()) * 3, Qt::Uninitialized);
+        m_offsets.push_back(quint32(m_file.pos()));
+        m_counts.push_back(quint32(row.size() * height));
+        m_rowsperstrip = std::max(m_rowsperstrip, height);
+        for (int y = 0; y < height; ++y) {
+            scanLine(tiles, y, row.data());
+            if (!put(row)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool finish() override {
+        if (m_file.pos() & 1) {
+            put("", 1);
+        }
+        // Values that do not fit an entry: bits per sample, resolutions, strip arrays
+        quint32 const extra = quint32(m_file.pos());
+        QByteArray data;
+        quint32 const bits = extra + quint32(data.size());
+        for (quint16 v : { 8, 8, 8, 0 }) {
+            append16(data, v);
+        }
+        quint32 const resolution = extra + quint32(data.size());
+        append32(data, 72);
+        append32(data, 1);
+        quint32 const offsets = extra + quint32(data.size());
+        for (quint32 o : m_offsets) {
+            append32(data, o);
+        }
+        quint32 const counts = extra + quint32(data.size());
+        for (quint32 c : m_counts) {
+            append32(data, c);
+        }
+        quint32 const ifd = extra + quint32(data.size());
+        bool const single = m_offsets.size() == 1;
+
+        QByteArray dir;
+        auto entry = [&dir](quint16 tag, quint16 type, quint32 count, quint32 value) {
+            append16(dir, tag);
+            append16(dir, type);
+            append32(dir, count);
+            if (type == 3 && count == 1) {
+                append16(dir, quint16(value));
+                append16(dir, 0);
+            } else {
+                append32(dir, value);
+            }
+        };
+        quint16 const constexpr shorttype = 3, longtype = 4, rationaltype = 5;
+        append16(dir, 14);
+        entry(256, longtype, 1, quint32(m_size.width()));
+        entry(257, longtype, 1, quint32(m_size.height()));
+        entry(258, shorttype, 3, bits);
+        entry(259, shorttype, 1, 1); // no compression
+        entry(262, shorttype, 1, 2); // RGB
+        entry(273, longtype, quint32(m_offsets.size()), single ? m_offsets.front() : offsets);
+        entry(274, shorttype, 1, 1); // top left
+        entry(277, shorttype, 1, 3);
+        entry(278, longtype, 1, quint32(m_rowsperstrip));
+        entry(279, longtype, quint32(m_counts.size()), single ? m_counts.front() : counts);
+        entry(282, rationaltype, 1, resolution);
+        entry(283, rationaltype, 1, resolution);
+        entry(284, shorttype, 1, 1); // chunky
+        entry(296, shorttype, 1, 2); // inch
+        append32(dir, 0);
+
+        QByteArray ifdoffset;
+        append32(ifdoffset, ifd);
+        return put(data) && put(dir) && m_file.seek(4) && put(ifdoffset) && m_file.commit();
+    }
+
+private:
+    std::vector<quint32> m_offsets;
+    std::vector<quint32> m_counts;
+    int m_rowsperstrip = 0;
+};
+
+quint32 pngCrc(quint32 crc, char const *data, qsizetype size) {
+    static std::array<quint32, 256> const table = [] {
+        std::array<quint32, 256> t{};
+        for (quint32 n = 0; n < 256; ++n) {
+            quint32 c = n;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (qsizetype i = 0; i < size; ++i) {
+        crc = table[(crc ^ uchar(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// PNG with the IDAT stream written as it is produced. Built with zlib the rows are
+// deflated, without it they go into stored deflate blocks.
+class PngEncoder : public SheetEncoder {
+public:
+    using SheetEncoder::SheetEncoder;
+
+    ~PngEncoder() override {
+#ifdef IMGVIEW_HAVE_ZLIB
+        if (m_deflating) {
+            deflateEnd(&m_stream);
+        }
+#endif
+    }
+
+    bool begin(QSize size) override {
+        m_size = size;
+        if (!m_file.open(QIODevice::WriteOnly) || !put("\x89PNG\r\n\x1a\n", 8)) {
+            return false;
+        }
+        QByteArray ihdr;
+        append32be(ihdr, quint32(size.width()));
+        append32be(ihdr, quint32(size.height()));
+        ihdr.append(char(8)).append(char(2)).append(char(0)).append(char(0)).append(char(0)); // 8 bit RGB
+        if (!chunk("IHDR", ihdr)) {
+            return false;
+        }
+#ifdef IMGVIEW_HAVE_ZLIB
+        m_stream = z_stream{};
+        if (deflateInit(&m_stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            m_error = QStringLiteral(u"Cannot initialise deflate");
+            return false;
+        }
+        m_deflating = true;
+        return true;
+#else
+        m_pending.append(char(0x78)).append(char(0x01));
+        return true;
+#endif
+    }
+
+    bool write(QList<QImage> const &tiles) override {
+        QByteArray row(qsizetype(m_size.width()) * 3 + 1, Qt::Uninitialized);
+        for (int y = 0; y < tiles.front().height(); ++y) {
+            row[0] = 0; // no filter
+            scanLine(tiles, y, row.data() + 1);
+            if (!compress(row, false)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool finish() override {
+        return compress(QByteArray(), true) && chunk("IEND", QByteArray()) && m_file.commit();
+    }
+
+private:
+    static qsizetype const constexpr idatsize = 1 << 20;
+
+    bool chunk(char const *type, QByteArray const &data) {
+        QByteArray head;
+        append32be(head, quint32(data.size()));
+        head.append(type, 4);
+        quint32 const crc = pngCrc(pngCrc(0, type, 4), data.constData(), data.size());
+        QByteArray tail;
+        append32be(tail, crc);
+        return put(head) && put(data) && put(tail);
+    }
+
+    bool flushIdat(bool all) {
+        while (m_pending.size() >= idatsize || (all && !m_pending.isEmpty())) {
+            qsizetype const n = std::min(m_pending.size(), idatsize);
+            if (!chunk("IDAT", m_pending.first(n))) {
+                return false;
+            }
+            m_pending.remove(0, n);
+        }
+        return true;
+    }
+
+#ifdef IMGVIEW_HAVE_ZLIB
+    bool compress(QByteArray const &data, bool last) {
+        m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.constData()));
+        m_stream.avail_in = uInt(data.size());
+        std::array<char, 64 * 1024> out;
+        int result = Z_OK;
+        do {
+            m_stream.next_out = reinterpret_cast<Bytef *>(out.data());
+            m_stream.avail_out = uInt(out.size());
+            result = deflate(&m_stream, last ? Z_FINISH : Z_NO_FLUSH);
+            if (result == Z_STREAM_ERROR) {
+                m_error = QStringLiteral(u"Deflate failed");
+                return false;
+            }
+            m_pending.append(out.data(), qsizetype(out.size() - m_stream.avail_out));
+        } while (m_stream.avail_out == 0 || (last && result != Z_STREAM_END));
+        return flushIdat(last);
+    }
+#else
+    bool compress(QByteArray const &data, bool last) {
+        // Stored blocks hold at most 65535 bytes, the zlib trailer is the Adler-32 of the rows
+        for (uchar c : data) {
+            m_a = (m_a + c) % 65521;
+            m_b = (m_b + m_a) % 65521;
+        }
+        m_raw += data;
+        qsizetype const constexpr blocksize = 65535;
+        while (m_raw.size() >= blocksize || last) {
+            qsizetype const n = std::min(m_raw.size(), blocksize);
+            bool const final = last && n == m_raw.size();
+            m_pending.append(char(final ? 1 : 0));
+            m_pending.append(char(n & 0xff)).append(char(n >> 8));
+            m_pending.append(char(~n & 0xff)).append(char((~n >> 8) & 0xff));
+            m_pending.append(m_raw.constData(), n);
+            m_raw.remove(0, n);
+            if (final) {
+                append32be(m_pending, (m_b << 16) | m_a);
+                break;
+            }
+        }
+        return flushIdat(last);
+    }
+
+    QByteArray m_raw;
+    quint32 m_a = 1;
+    quint32 m_b = 0;
+#endif
+
+    QByteArray m_pending;
+#ifdef IMGVIEW_HAVE_ZLIB
+    z_stream m_stream{};
+    bool m_deflating = false;
+#endif
+};
+}
+
+std::unique_ptr<SheetEncoder> SheetEncoder::create(QString const &filename) {
+    QString const suffix = QFileInfo(filename).suffix().toLower();
+    if (suffix == QStringLiteral(u"tif") || suffix == QStringLiteral(u"tiff")) {
+        return std::make_unique<TiffEncoder>(filename);
+    }
+    return std::make_unique<PngEncoder>(filename);
+}
+
+namespace {
+// Width a band is drawn in, in pixels; a tile is drawn and converted on one decode worker
+int const constexpr tilewidth = 2048;
+// Rendered bands waiting for the writer plus the ones being drawn, in bytes. At least one
+// band is always in flight, however wide the sheet is.
+qint64 const constexpr bandbudget = 256 * 1024 * 1024;
+}
+
+ContactSheet::ContactSheet(ImageCatalog const &catalog, std::vector<int> cells, int columns, int cellsize, QString filename, ImageHashStore *store,
+                           QObject *parent)
+    : QObject(parent)
+    , m_catalog(catalog)
+    , m_cells(std::move(cells))
+    , m_columns(std::max(1, columns))
+    , m_cellsize(cellsize)
+    , m_rows((int(m_cells.size()) + m_columns - 1) / m_columns)
+    , m_level(ThumbLevel::forCell(cellsize))
+    , m_tilecells(std::max(1, tilewidth / cellsize))
+    , m_filename(std::move(filename))
+    , m_store(store)
+    , m_relay(std::make_shared<Relay<ContactSheet>>(this))
+    , m_encoder(SheetEncoder::create(m_filename)) {
+    qint64 const bandbytes = qint64(m_columns) * m_cellsize * m_cellsize * 3;
+    m_maxbands = int(std::clamp<qint64>(bandbudget / bandbytes, 1, std::max(2, ImagePipeline::instance().decode.threads())));
+    m_writer.setMaxThreadCount(1);
+}
+
+ContactSheet::~ContactSheet() {
+    // Tasks still queued return at their next check, the sheet file is discarded unless committed
+    m_cancel.cancel();
+    m_relay->detach();
+}
+
+void ContactSheet::start() {
+    if (m_cells.empty()) {
+        emit finished(false, QStringLiteral(u"Nothing to export"));
+        return;
+    }
+    if (!m_encoder->begin(QSize(m_columns * m_cellsize, m_rows * m_cellsize))) {
+        fail(m_encoder->errorString());
+        return;
+    }
+    startBands();
+}
+
+void ContactSheet::startBands() {
+    while (!m_failed && m_nextrow < m_rows && m_nextrow - m_written < m_maxbands) {
+        startBand(m_nextrow++);
+    }
+}
+
+void ContactSheet::startBand(int row) {
+    int const first = row * m_columns;
+    int const count = std::min(m_columns, int(m_cells.size()) - first);
+    Band &band = m_bands[row];
+    band.stored.resize(count);
+    band.generated.resize(count);
+    band.pending = count;
+
+    // Work items only for the band being started, positions route the results back
+    QList<WorkItem> wis;
+    wis.reserve(count);
+    for (int pos = first; pos < first + count; ++pos) {
+        WorkItem wi = m_catalog.workItem(m_cells[pos]);
+        wi.m_idx = pos;
+        wi.m_level = m_level;
+        wi.m_cancel = m_cancel.token();
+        wis.push_back(std::move(wi));
+    }
+
+    // Lookups run on the database thread, the misses are generated by the loader stages
+    QMetaObject::invokeMethod(m_store, [relay = m_relay, store = m_store, wis]() {
+        QList<WorkItem> found, missing;
+        QList<QByteArray> thumbs;
+        QList<QSize> sizes;
+        store->lookupThumbs(wis, found, thumbs, sizes, missing);
+        Relay<ContactSheet>::deliver(relay, wis.front().m_cancel, [found, thumbs, missing](ContactSheet *sheet) {
+            sheet->foundThumbs(found, thumbs);
+            sheet->generateThumbs(missing);
+        });
+    }, Qt::QueuedConnection);
+}
+
+void ContactSheet::foundThumbs(QList<WorkItem> wis, QList<QByteArray> thumbs) {
+    for (qsizetype i = 0; i < wis.size(); ++i) {
+        int const pos = wis[i].m_idx;
+        m_bands[pos / m_columns].stored[pos % m_columns] = thumbs[i];
+        cellDone(pos);
+    }
+}
+
+void ContactSheet::generateThumbs(QList<WorkItem> wis) {
+    for (auto wi : wis) {
+        wi.loadthumb = true;
+        wi.m_keymissed = true;
+        ImageLoaderTask *ilt = new ImageLoaderTask(wi, m_store);
+        connect(ilt, &ImageLoaderTask::loaded, this, [this](WorkItem done, QImage, QImage thumb, QSize) {
+            int const pos = done.m_idx;
+            m_bands[pos / m_columns].generated[pos % m_columns] = std::move(thumb);
+            cellDone(pos);
+        }, Qt::QueuedConnection);
+        connect(ilt, &ImageLoaderTask::loadedThumbData, m_store, &ImageHashStore::insertThumb, Qt::QueuedConnection);
+        ilt->start();
+    }
+}
+
+void ContactSheet::cellDone(int pos) {
+    int const row = pos / m_columns;
+    if (--m_bands[row].pending == 0) {
+        render(row);
+    }
+}
+
+void ContactSheet::render(int row) {
+    Band &band = m_bands[row];
+    int const tiles = (m_columns + m_tilecells - 1) / m_tilecells;
+    band.tiles.resize(tiles);
+    band.pendingtiles = tiles;
+    for (int tile = 0; tile < tiles; ++tile) {
+        int const first = tile * m_tilecells;
+        int const cells = std::min(m_tilecells, m_columns - first);
+        QList<int> orientations;
+        for (int c = first; c < first + cells && c < band.stored.size(); ++c) {
+            orientations.push_back(m_catalog.orientation(m_cells[row * m_columns + c]));
+        }
+        ImagePipeline::instance().decode.submit([relay = m_relay, row, tile, stored = band.stored.mid(first, cells), generated = band.generated.mid(first, cells),
+                                                 orientations, cells, cellsize = m_cellsize, token = m_cancel.token()]() {
+            if (token.isCancelled()) {
+                return;
+            }
+            QImage image = renderTile(stored, generated, orientations, cells, cellsize);
+            Relay<ContactSheet>::deliver(relay, token, [row, tile, image](ContactSheet *sheet) { sheet->rendered(row, tile, image); });
+        }, ImagePipeline::thumbnail);
+    }
+    // The tiles hold what they draw, the band keeps only their results
+    band.stored.clear();
+    band.generated.clear();
+}
+
+QImage ContactSheet::renderTile(QList<QByteArray> const &stored, QList<QImage> const &generated, QList<int> const &orientations, int cells,
+                                int cellsize) {
+    QImage image(cells * cellsize, cellsize, QImage::Format_RGB32);
+    image.fill(Qt::white);
+    QPainter p(&image);
+    p.setRenderHint(QPainter::SmoothPixmapTransform);
+    for (qsizetype c = 0; c < stored.size(); ++c) {
+        QImage const thumb = generated[c].isNull() ? QImage::fromData(stored[c]) : generated[c];
+        if (thumb.isNull()) {
+            continue;
+        }
+        // Laid out like ImgView::drawOriented, the EXIF orientation is part of the transform
+        int const orientation = orientations.value(c, 1);
+        QSizeF const shown = ImageMetadata::orientedSize(thumb.size(), orientation).toSizeF().scaled(QSizeF(cellsize, cellsize), Qt::KeepAspectRatio);
+        QSizeF const size = (orientation >= 5) ? shown.transposed() : shown;
+        p.save();
+        p.translate(QRectF(QPointF(c * cellsize, 0), shown).center());
+        p.setTransform(ImageMetadata::orientationTransform(orientation), true);
+        p.drawImage(QRectF(QPointF(-size.width() / 2., -size.height() / 2.), size), thumb);
+        p.restore();
+    }
+    p.end();
+    // The encoders take packed RGB, converting here keeps it off the writer
+    return image.convertToFormat(QImage::Format_RGB888);
+}
+
+void ContactSheet::rendered(int row, int tile, QImage image) {
+    Band &band = m_bands[row];
+    band.tiles[tile] = std::move(image);
+    if (--band.pendingtiles > 0) {
+        return;
+    }
+    // Bands finish in any order, the writer takes them in order
+    m_rendered.insert(row, m_bands.take(row).tiles);
+    while (!m_failed && !m_rendered.isEmpty() && m_rendered.firstKey() == m_nextwrite) {
+        QList<QImage> tiles = m_rendered.take(m_nextwrite++);
+        m_writer.start([relay = m_relay, encoder = m_encoder.get(), tiles]() {
+            bool const ok = encoder->write(tiles);
+            Relay<ContactSheet>::deliver(relay, CancelToken(), [ok](ContactSheet *sheet) { sheet->written(ok); });
+        });
+    }
+}
+
+void ContactSheet::written(bool ok) {
+    if (m_failed) {
+        return;
+    }
+    if (!ok) {
+        fail(m_encoder->errorString());
+        return;
+    }
+    m_written++;
+    emit progress(m_written);
+    if (m_written < m_rows) {
+        startBands();
+        return;
+    }
+    if (!m_encoder->finish()) {
+        fail(m_encoder->errorString());
+        return;
+    }
+    qDebug() << "contact sheet" << m_filename << m_columns * m_cellsize << "x" << m_rows * m_cellsize;
+    emit finished(true, QStringLiteral(u"Contact sheet written to %1").arg(m_filename));
+}
+
+void ContactSheet::fail(QString const &error) {
+    m_failed = true;
+    m_cancel.cancel();
+    m_writer.clear();
+    qWarning() << "contact sheet" << m_filename << "failed:" << error;
+    emit finished(false, QStringLiteral(u"Contact sheet failed: %1").arg(error));
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <QHash>
+#include <QImage>
+#include <QMap>
+#include <QObject>
+#include <QThreadPool>
+#include <memory>
+#include <vector>
+
+#include "CancelToken.h"
+#include "Relay.h"
+#include "WorkItem.h"
+
+class ImageCatalog;
+class ImageHashStore;
+class SheetEncoder;
+
+// Exports a grid of images as one large PNG or TIFF. Every grid row is a band: its
+// thumbnails come from thumbs.db or are generated by ImageLoaderTasks, the decode stage
+// draws the band in tiles of a fixed width and a single writer streams the finished bands
+// in order to the encoder. Bands in flight are bounded by their size in bytes, so memory
+// does not grow with the number of images beyond a single band.
+class ContactSheet : public QObject {
+    Q_OBJECT
+public:
+    // cells holds the catalog index of each grid position; the catalog must stay as it is
+    // while the sheet exists
+    ContactSheet(ImageCatalog const &catalog, std::vector<int> cells, int columns, int cellsize, QString filename, ImageHashStore *store,
+                 QObject *parent = nullptr);
+    ~ContactSheet();
+
+    void start();
+    int rows() const { return m_rows; }
+
+signals:
+    void progress(int rows);
+    void finished(bool ok, QString message);
+
+private:
+    struct Band {
+        QList<QByteArray> stored;
+        QList<QImage> generated;
+        int pending = 0;
+        QList<QImage> tiles;
+        int pendingtiles = 0;
+    };
+
+    void startBands();
+    void startBand(int row);
+    void foundThumbs(QList<WorkItem> wis, QList<QByteArray> thumbs);
+    void generateThumbs(QList<WorkItem> wis);
+    void cellDone(int pos);
+    void render(int row);
+    void rendered(int row, int tile, QImage image);
+    void written(bool ok);
+    void fail(QString const &error);
+    static QImage renderTile(QList<QByteArray> const &stored, QList<QImage> const &generated, QList<int> const &orientations, int cells,
+                             int cellsize);
+
+    ImageCatalog const &m_catalog;
+    std::vector<int> m_cells;
+    int m_columns;
+    int m_cellsize;
+    int m_rows;
+    int m_level;
+    int m_tilecells;
+    int m_maxbands;
+    QString m_filename;
+    ImageHashStore *m_store;
+    CancelSource m_cancel;
+    // Lookups and pool jobs post back through it, the destructor detaches it
+    std::shared_ptr<Relay<ContactSheet>> m_relay;
+    QHash<int, Band> m_bands;
+    QMap<int, QList<QImage>> m_rendered;
+    int m_nextrow = 0;
+    int m_nextwrite = 0;
+    int m_written = 0;
+    bool m_failed = false;
+    std::unique_ptr<SheetEncoder> m_encoder;
+    // Declared last so it is destroyed first, running writes finish before the encoder goes
+    QThreadPool m_writer;
+};
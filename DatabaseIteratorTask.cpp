@@ -0,0 +1,78 @@
+#include "DatabaseIteratorTask.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+
+#include "ImageHashStore.h"
+
+void DatabaseIteratorTask::run()
+{
+    QElapsedTimer ti;
+    ti.start();
+
+    QString const connection = QStringLiteral(u"DatabaseIteratorTask%1").arg(reinterpret_cast<quintptr>(this));
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connection);
+        db.setDatabaseName(ImageHashStore::databasePath());
+        db.setConnectOptions(QStringLiteral(u"QSQLITE_OPEN_READONLY"));
+        if (!db.open()) {
+            qWarning() << "Open catalog failed:" << db.lastError().text();
+        } else {
+            // Keyset pagination: every page continues after the last (filepath, hash) seen,
+            // so each page is an index range scan no matter how deep we are in the table
+            QSqlQuery firstpage(db), nextpage(db);
+            firstpage.setForwardOnly(true);
+            nextpage.setForwardOnly(true);
+            QString const columns = QStringLiteral(u"SELECT hash, filepath, filesize, width, height FROM images ");
+            firstpage.prepare(columns + QStringLiteral(u"ORDER BY filepath, hash LIMIT :limit"));
+            nextpage.prepare(columns + QStringLiteral(u"WHERE (filepath, hash) > (:filepath, :hash) ORDER BY filepath, hash LIMIT :limit"));
+
+            QString lastpath;
+            QByteArray lasthash;
+            bool first = true;
+            int rows = 0;
+            while (!m_cancel.isCancelled()) {
+                QSqlQuery &query = first ? firstpage : nextpage;
+                if (!first) {
+                    query.bindValue(":filepath", lastpath);
+                    query.bindValue(":hash", lasthash);
+                }
+                query.bindValue(":limit", m_pagesize);
+                if (!query.exec()) {
+                    qWarning() << "Read catalog failed:" << query.lastError().text();
+                    break;
+                }
+
+                QList<CatalogEntry> page;
+                while (query.next()) {
+                    CatalogEntry ce;
+                    lasthash = query.value(0).toByteArray();
+                    lastpath = query.value(1).toString();
+                    ce.wi.m_hash = lasthash;
+                    ce.wi.m_cancel = m_cancel;
+                    ce.wi.m_storeonly = true;
+                    ce.wi.fi = QFileInfo(lastpath);
+                    ce.wi.m_filesize = query.value(2).toLongLong();
+                    ce.size = QSize(query.value(3).toInt(), query.value(4).toInt());
+                    page.push_back(std::move(ce));
+                }
+                query.finish();
+                first = false;
+
+                if (page.isEmpty()) {
+                    break;
+                }
+                rows += page.size();
+                bool const lastpage = page.size() < m_pagesize;
+                emit loadedCatalog(std::move(page));
+                if (lastpage) {
+                    break;
+                }
+            }
+            qDebug() << "catalog streamed" << rows << "rows in" << ti.elapsed() << "ms";
+        }
+    }
+    QSqlDatabase::removeDatabase(connection);
+}
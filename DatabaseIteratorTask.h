@@ -0,0 +1,33 @@
+#pragma once
+#include <QObject>
+#include <QRunnable>
+#include <QSize>
+
+#include "WorkItem.h"
+
+struct CatalogEntry {
+    WorkItem wi;
+    QSize size;
+};
+
+// Streams the rows of thumbs.db page by page without touching the source files. Only keys,
+// paths and sizes are read; thumbnails are looked up by the view for the cells it shows.
+class DatabaseIteratorTask : public QObject, public QRunnable {
+    Q_OBJECT
+
+    int m_pagesize;
+    CancelToken m_cancel;
+
+public:
+    DatabaseIteratorTask(int pagesize = 256) : m_pagesize(pagesize) {
+        setAutoDelete(true);
+    }
+
+    // Stops paging once the token is cancelled, the entries it emits carry the token
+    void setCancelToken(CancelToken token) { m_cancel = std::move(token); }
+
+    void run() override;
+
+signals:
+    void loadedCatalog(QList<CatalogEntry> list);
+};
@@ -1,8 +1,93 @@
 #include "DirIteratorTask.h"
 #include <QElapsedTimer>
+#include <QScopeGuard>
+
+#include "ArchiveIndex.h"
+#include "ImageHashStore.h"
+
+WorkItem DirIteratorTask::workItem(QFileInfo const &fi)
+{
+    // Keying needs a stat, do it here instead of on the GUI thread
+    WorkItem wi;
+    wi.fi = fi;
+    wi.m_hash = ImageHashStore::keyFor(fi);
+    wi.m_filesize = fi.size();
+    return wi;
+}
+
+void DirIteratorTask::listArchive(QFileInfo const &archive, QList<WorkItem> &items)
+{
+    // Members show up as files of a virtual folder named like the archive
+    auto const index = ArchiveIndex::open(archive.absoluteFilePath());
+    if (!index) {
+        return;
+    }
+    for (auto const &entry : index->entries()) {
+        if (supportedExtensions().contains(QFileInfo(entry.name).suffix().toLower())) {
+            WorkItem wi;
+            wi.fi = QFileInfo(archive.absoluteFilePath() + '/' + entry.name);
+            wi.m_hash = ImageHashStore::memberKeyFor(archive, entry.name);
+            wi.m_filesize = entry.size;
+            items.push_back(wi);
+        }
+    }
+}
+
+void DirIteratorTask::addFolder(QString const &folder, QList<WorkItem> &items)
+{
+    WorkItem cover;
+    if (m_cover.m_idx >= 0 && m_cover.fi.absoluteFilePath().startsWith(folder + '/')) {
+        cover = m_cover;
+    } else if (!findCover(folder, cover)) {
+        // Nothing to show below it
+        return;
+    }
+    cover.m_folder = folder;
+    items.push_back(cover);
+}
+
+bool DirIteratorTask::findCover(QString const &folder, WorkItem &cover)
+{
+    // The first image below the folder, the walk stops there
+    QDirIterator it(folder, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext() && !m_cancel.isCancelled()) {
+        QFileInfo const fi(it.next());
+        if (supportedExtensions().contains(fi.suffix().toLower())) {
+            cover = workItem(fi);
+            return true;
+        }
+        if (ArchiveIndex::isArchive(fi)) {
+            QList<WorkItem> members;
+            listArchive(fi, members);
+            if (!members.isEmpty()) {
+                cover = members.front();
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void DirIteratorTask::emitItems(QList<WorkItem> &items)
+{
+    // The cover is in the catalog already, it only comes again as cover of a subfolder
+    if (m_cover.m_idx >= 0) {
+        QString const cover = m_cover.fi.absoluteFilePath();
+        items.removeIf([&cover](WorkItem const &wi) { return wi.m_idx < 0 && wi.fi.absoluteFilePath() == cover; });
+    }
+    for (auto &wi : items) {
+        wi.m_cancel = m_cancel;
+    }
+    emit loadedFilenames(items);
+    items.clear();
+    if (m_gate) {
+        m_gate->wait(m_cancel);
+    }
+}
 
 void DirIteratorTask::run()
 {
+    auto const done = qScopeGuard([this] { emit finished(); });
     QElapsedTimer ti;
     ti.start();
 
@@ -17,38 +102,51 @@ void DirIteratorTask::run()
     for (auto const& fn : m_fns) {
         QFileInfo const fi(fn);
         if (supportedExtensions().contains(fi.suffix().toLower())) {
-            newimageitems.push_back(WorkItem(fi));
-            filetoshowfirst = fn;
+            if (!m_listed) {
+                newimageitems.push_back(workItem(fi));
+            }
+            filetoshowfirst = fi.absoluteFilePath();
+        } else if (ArchiveIndex::isArchive(fi) && fi.isFile()) {
+            listArchive(fi, newimageitems);
         }
     }
 
     if (!newimageitems.isEmpty()) {
-        emit loadedFilenames(newimageitems);
-        newimageitems.clear();
+        emitItems(newimageitems);
     }
 
-    // If we got a list of files, only load these
+    // If we got a list of files or an archive, only load these
     if ((m_fns.size() > 1) && !QFileInfo(m_fns.front()).isDir()) {
         return;
     }
+    if (QFileInfo const first(m_fns.front()); ArchiveIndex::isArchive(first) && first.isFile()) {
+        return;
+    }
 
     // If it is a directory or only one file, iterate the directory
     QFileInfo fi(m_fns.front());
     QString dir = fi.isDir() ? fi.absoluteFilePath() : fi.absolutePath();
-    QDirIterator it(dir, QDir::Files, m_itf);
+    QDirIterator it(dir, m_folders ? (QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot) : QDir::Files,
+                    m_folders ? QDirIterator::NoIteratorFlags : m_itf);
     while (it.hasNext()) {
+        if (m_cancel.isCancelled()) {
+            return;
+        }
         QString const file = it.next();
         if (file != filetoshowfirst) {
             QFileInfo const fi(file);
-            if (DirIteratorTask::supportedExtensions().contains(fi.suffix().toLower())) {
-                newimageitems.push_back(WorkItem(fi));
+            if (m_folders && fi.isDir()) {
+                addFolder(fi.absoluteFilePath(), newimageitems);
+            } else if (DirIteratorTask::supportedExtensions().contains(fi.suffix().toLower())) {
+                newimageitems.push_back(workItem(fi));
+            } else if ((m_folders || (m_itf & QDirIterator::Subdirectories)) && ArchiveIndex::isArchive(fi)) {
+                listArchive(fi, newimageitems);
             }
         }
 
         if ((ti.elapsed() > 10) || !it.hasNext()) {
             ti.restart();
-            emit loadedFilenames(newimageitems);
-            newimageitems.clear();
+            emitItems(newimageitems);
         }
     }
 }
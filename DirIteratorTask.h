@@ -3,17 +3,53 @@
 #include <QRunnable>
 #include <QDirIterator>
 #include <QImageReader>
+#include <QMutex>
+#include <QWaitCondition>
+#include <memory>
 
 #include "WorkItem.h"
 
+// Lets the receiver of loadedFilenames hold the walk back while it has too much queued.
+// The receiver closes and opens it, the iterator waits between batches while it is closed.
+class EnumerationGate {
+public:
+    void close() {
+        QMutexLocker lock(&m_mutex);
+        m_open = false;
+    }
+    void open() {
+        QMutexLocker lock(&m_mutex);
+        m_open = true;
+        m_opened.wakeAll();
+    }
+    // Returns once the gate is open or the token is cancelled
+    void wait(CancelToken const &cancel) {
+        QMutexLocker lock(&m_mutex);
+        while (!m_open && !cancel.isCancelled()) {
+            m_opened.wait(&m_mutex, 100);
+        }
+    }
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_opened;
+    bool m_open = true;
+};
+
 class DirIteratorTask : public QObject, public QRunnable {
     Q_OBJECT
 
     QStringList m_fns;
     QDirIterator::IteratorFlag m_itf;
+    bool m_listed;
+    CancelToken m_cancel;
+    bool m_folders = false;
+    WorkItem m_cover;
+    std::shared_ptr<EnumerationGate> m_gate;
 
 public:
-    DirIteratorTask(QStringList fns, QDirIterator::IteratorFlag itf) : m_fns(fns), m_itf(itf){
+    // listed: the files given in fns are already in the catalog, only emit the rest of the directory
+    DirIteratorTask(QStringList fns, QDirIterator::IteratorFlag itf, bool listed = false) : m_fns(fns), m_itf(itf), m_listed(listed){
         setAutoDelete(true);
     }
 
@@ -31,8 +67,28 @@ public:
         return extensions;
     }
 
+    // The walk stops once the token is cancelled, the items it emits carry the token
+    void setCancelToken(CancelToken token) { m_cancel = std::move(token); }
+    // Each batch waits for the gate to be open before the walk goes on
+    void setGate(std::shared_ptr<EnumerationGate> gate) { m_gate = std::move(gate); }
+    // Lists only the top of the directory, each subfolder comes as its first image with
+    // m_folder set. cover is the catalog entry that stood for the directory, it is not
+    // emitted again unless it stays the cover of the subfolder it is in.
+    void setFolderCovers(WorkItem cover = WorkItem()) {
+        m_folders = true;
+        m_cover = std::move(cover);
+    }
+
     void run() override;
+    static WorkItem workItem(QFileInfo const &fi);
+
+private:
+    static void listArchive(QFileInfo const &archive, QList<WorkItem> &items);
+    void emitItems(QList<WorkItem> &items);
+    void addFolder(QString const &folder, QList<WorkItem> &items);
+    bool findCover(QString const &folder, WorkItem &cover);
 
 signals:
     void loadedFilenames(QList<WorkItem> list);
+    void finished();
 };
@@ -0,0 +1,139 @@
+#include "ImageBufferPool.h"
+#include <QDebug>
+#include <QMutexLocker>
+#include <QSettings>
+#include <bit>
+#include <new>
+
+#ifdef Q_OS_LINUX
+#include <sys/mman.h>
+#endif
+
+#include "Bench.h"
+
+namespace {
+size_t const constexpr alignment = 64;
+size_t const constexpr hugepage = 2 * 1024 * 1024;
+}
+
+ImageBufferPool &ImageBufferPool::instance() {
+    // Never destroyed, images may still hand buffers back during static destruction
+    static ImageBufferPool *pool = new ImageBufferPool;
+    return *pool;
+}
+
+ImageBufferPool::ImageBufferPool() {
+    QSettings const settings("ImgView", "ImgView");
+    m_budget = std::max<qint64>(0, settings.value("BufferPoolMB", 512).toLongLong()) * 1024 * 1024;
+#ifdef Q_OS_LINUX
+    m_hugepages = settings.value("BufferPoolHugePages", true).toBool();
+#endif
+}
+
+size_t ImageBufferPool::sizeClass(size_t bytes) const {
+    // Eight classes per power of two, huge page backed buffers in whole huge pages
+    size_t const step = std::max<size_t>(std::bit_floor(bytes) / 8, m_hugepages ? hugepage : alignment);
+    return (bytes + step - 1) / step * step;
+}
+
+void *ImageBufferPool::allocate(size_t bytes) {
+#ifdef Q_OS_LINUX
+    void *data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    if (m_hugepages) {
+        madvise(data, bytes, MADV_HUGEPAGE);
+    }
+    return data;
+#else
+    return ::operator new(bytes, std::align_val_t(alignment), std::nothrow);
+#endif
+}
+
+void ImageBufferPool::deallocate(void *data, size_t bytes) {
+#ifdef Q_OS_LINUX
+    munmap(data, bytes);
+#else
+    Q_UNUSED(bytes);
+    ::operator delete(data, std::align_val_t(alignment));
+#endif
+}
+
+QImage ImageBufferPool::image(QSize size, QImage::Format format) {
+    int const depth = QImage::toPixelFormat(format).bitsPerPixel();
+    qsizetype const bpl = (qsizetype(size.width()) * depth + 31) / 32 * 4;
+    qint64 const bytes = bpl * size.height();
+    if (m_budget <= 0 || bytes < minbytes || size.isEmpty()) {
+        return QImage(size, format);
+    }
+
+    size_t const sizeclass = sizeClass(size_t(bytes));
+    void *data = nullptr;
+    {
+        QMutexLocker lock(&m_mutex);
+        auto it = m_free.find(sizeclass);
+        if (it != m_free.end() && !it->second.empty()) {
+            data = it->second.back();
+            it->second.pop_back();
+            m_freebytes -= qint64(sizeclass);
+        }
+    }
+    Bench::count(data ? QStringLiteral(u"pool.hit") : QStringLiteral(u"pool.miss"));
+    if (!data) {
+        data = allocate(sizeclass);
+        if (!data) {
+            return QImage(size, format);
+        }
+    }
+
+    Block *block = new Block{ this, data, sizeclass };
+    QImage image(static_cast<uchar *>(data), size.width(), size.height(), bpl, format, &ImageBufferPool::release, block);
+    if (image.isNull()) {
+        recycle(block);
+        return QImage(size, format);
+    }
+    return image;
+}
+
+void ImageBufferPool::release(void *info) {
+    Block *block = static_cast<Block *>(info);
+    block->pool->recycle(block);
+}
+
+void ImageBufferPool::recycle(Block *block) {
+    bool keep = false;
+    {
+        QMutexLocker lock(&m_mutex);
+        if (m_freebytes + qint64(block->size) <= m_budget) {
+            m_free[block->size].push_back(block->data);
+            m_freebytes += qint64(block->size);
+            keep = true;
+        }
+    }
+    if (!keep) {
+        deallocate(block->data, block->size);
+    }
+    delete block;
+}
+
+void ImageBufferPool::setBudget(qint64 bytes) {
+    qint64 const old = m_budget.exchange(std::max<qint64>(0, bytes));
+    if (bytes < old) {
+        trim();
+    }
+}
+
+void ImageBufferPool::trim() {
+    std::map<size_t, std::vector<void *>> idle;
+    {
+        QMutexLocker lock(&m_mutex);
+        idle.swap(m_free);
+        m_freebytes = 0;
+    }
+    for (auto const &[size, buffers] : idle) {
+        for (void *data : buffers) {
+            deallocate(data, size);
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <QImage>
+#include <QMutex>
+#include <QSize>
+#include <atomic>
+#include <map>
+#include <vector>
+
+// Recycles the pixel buffers of large decoded images. Without it, browsing through big
+// images maps, faults in, zeroes and unmaps hundreds of megabytes per image. Buffers are
+// kept in size classes, eight per power of two so at most an eighth is wasted, and idle
+// ones are kept up to a budget (settings key "BufferPoolMB", 0 turns the pool off). On
+// Linux "BufferPoolHugePages" backs them with transparent huge pages.
+// An image from the pool hands its buffer back when its last copy is gone, on whatever
+// thread that happens.
+class ImageBufferPool {
+public:
+    static ImageBufferPool &instance();
+
+    // Uninitialised pixels, taken from the pool for large images
+    QImage image(QSize size, QImage::Format format);
+    // Frees the idle buffers
+    void trim();
+    // Idle bytes kept at most, 0 turns the pool off; lowered by the MemoryGovernor
+    qint64 budget() const { return m_budget; }
+    void setBudget(qint64 bytes);
+
+    // Smaller buffers come from the allocator's own free lists anyway
+    static qint64 const constexpr minbytes = 8 * 1024 * 1024;
+
+private:
+    ImageBufferPool();
+    struct Block {
+        ImageBufferPool *pool;
+        void *data;
+        size_t size;
+    };
+    static void release(void *info);
+    void recycle(Block *block);
+    size_t sizeClass(size_t bytes) const;
+    void *allocate(size_t bytes);
+    void deallocate(void *data, size_t bytes);
+
+    QMutex m_mutex;
+    std::map<size_t, std::vector<void *>> m_free;
+    qint64 m_freebytes = 0;
+    std::atomic<qint64> m_budget = 0;
+    bool m_hugepages = false;
+};
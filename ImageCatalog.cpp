@@ -0,0 +1,139 @@
+#include "ImageCatalog.h"
+#include <cstring>
+
+quint32 PixmapPool::insert(QPixmap pixmap) {
+    if (!m_free.empty()) {
+        quint32 const handle = m_free.back();
+        m_free.pop_back();
+        m_slots[handle - 1] = std::move(pixmap);
+        return handle;
+    }
+    m_slots.push_back(std::move(pixmap));
+    return quint32(m_slots.size());
+}
+
+void PixmapPool::release(quint32 handle) {
+    if (handle) {
+        m_slots[handle - 1] = QPixmap();
+        m_free.push_back(handle);
+    }
+}
+
+void PixmapPool::clear() {
+    m_slots.clear();
+    m_free.clear();
+}
+
+void ImageCatalog::clear() {
+    m_dirs.clear();
+    m_dirindex.clear();
+    m_names.clear();
+    m_dir.clear();
+    m_nameoffset.clear();
+    m_hash.clear();
+    m_filesize.clear();
+    m_imagesize.clear();
+    m_orientation.clear();
+    m_captured.clear();
+    m_thumb.clear();
+    m_image.clear();
+    m_pixmaps.clear();
+    m_resident.clear();
+    m_thumbbytes = 0;
+}
+
+int ImageCatalog::append(WorkItem const &wi) {
+    QString const dir = wi.fi.absolutePath();
+    auto it = m_dirindex.constFind(dir);
+    if (it == m_dirindex.cend()) {
+        it = m_dirindex.insert(dir, quint32(m_dirs.size()));
+        m_dirs.push_back(dir);
+    }
+    m_dir.push_back(it.value());
+
+    m_nameoffset.push_back(quint32(m_names.size()));
+    m_names += wi.fi.fileName();
+
+    Key key{};
+    std::memcpy(key.data(), wi.m_hash.constData(), std::min<size_t>(key.size(), size_t(wi.m_hash.size())));
+    m_hash.push_back(key);
+    m_filesize.push_back(wi.m_filesize);
+    m_imagesize.push_back(QSize());
+    m_orientation.push_back(1);
+    m_captured.push_back(0);
+    m_thumb.push_back(0);
+    m_image.push_back(0);
+    return size() - 1;
+}
+
+QStringView ImageCatalog::fileNameView(int idx) const {
+    quint32 const begin = m_nameoffset[idx];
+    quint32 const end = (idx + 1 < size()) ? m_nameoffset[idx + 1] : quint32(m_names.size());
+    return QStringView(m_names).mid(begin, end - begin);
+}
+
+QString ImageCatalog::filePath(int idx) const {
+    return absolutePath(idx) + '/' + fileName(idx);
+}
+
+bool ImageCatalog::matches(int idx, QByteArray const &hash) const {
+    return idx >= 0 && idx < size() && hash.size() == qsizetype(m_hash[idx].size()) &&
+           std::memcmp(m_hash[idx].data(), hash.constData(), m_hash[idx].size()) == 0;
+}
+
+void ImageCatalog::setMetadata(int idx, int orientation, qint64 captured) {
+    m_orientation[idx] = quint8(orientation);
+    m_captured[idx] = captured;
+}
+
+WorkItem ImageCatalog::workItem(int idx) const {
+    WorkItem wi;
+    wi.fi = QFileInfo(filePath(idx));
+    wi.m_hash = hash(idx);
+    wi.m_filesize = m_filesize[idx];
+    wi.m_idx = idx;
+    return wi;
+}
+
+namespace {
+qint64 pixmapBytes(QPixmap const *pixmap) {
+    return pixmap ? qint64(pixmap->width()) * pixmap->height() * pixmap->depth() / 8 : 0;
+}
+}
+
+void ImageCatalog::setThumb(int idx, QPixmap thumb) {
+    releaseThumb(idx);
+    m_thumb[idx] = m_pixmaps.insert(std::move(thumb));
+    m_thumbbytes += pixmapBytes(m_pixmaps.get(m_thumb[idx]));
+    m_resident.insert(idx);
+}
+
+void ImageCatalog::releaseThumb(int idx) {
+    m_thumbbytes -= pixmapBytes(m_pixmaps.get(m_thumb[idx]));
+    m_pixmaps.release(m_thumb[idx]);
+    m_thumb[idx] = 0;
+    m_resident.remove(idx);
+}
+
+void ImageCatalog::setImage(int idx, QPixmap image) {
+    m_pixmaps.release(m_image[idx]);
+    m_image[idx] = m_pixmaps.insert(std::move(image));
+}
+
+void ImageCatalog::releaseImage(int idx) {
+    m_pixmaps.release(m_image[idx]);
+    m_image[idx] = 0;
+}
+
+double ImageCatalog::bytesPerEntry() const {
+    if (isEmpty()) {
+        return 0.;
+    }
+    size_t const fixed = sizeof(quint32) + sizeof(quint32) + sizeof(Key) + sizeof(qint64) + sizeof(QSize) + sizeof(quint8) + sizeof(qint64) + 2 * sizeof(quint32);
+    size_t dirs = 0;
+    for (auto const &d : m_dirs) {
+        // String data plus the hash node of the interning table
+        dirs += d.size() * sizeof(QChar) + 64;
+    }
+    return fixed + double(m_names.size() * sizeof(QChar) + dirs) / size();
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <QHash>
+#include <QPixmap>
+#include <QSet>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <array>
+#include <vector>
+
+#include "WorkItem.h"
+
+// Handle based storage for pixmaps, handle 0 means "none"
+class PixmapPool {
+public:
+    quint32 insert(QPixmap pixmap);
+    void release(quint32 handle);
+    QPixmap const *get(quint32 handle) const {
+        return handle ? &m_slots[handle - 1] : nullptr;
+    }
+    void clear();
+
+private:
+    std::vector<QPixmap> m_slots;
+    std::vector<quint32> m_free;
+};
+
+// All listed images as one struct of arrays: every field is a contiguous array indexed by
+// the catalog index, directories are interned and file names are packed into one string.
+// Thumbnails and full images live in a PixmapPool and are referenced by handle.
+class ImageCatalog {
+public:
+    using Key = std::array<char, 32>;
+
+    int size() const { return int(m_dir.size()); }
+    bool isEmpty() const { return m_dir.empty(); }
+    void clear();
+    int append(WorkItem const &wi);
+
+    QString fileName(int idx) const { return fileNameView(idx).toString(); }
+    QStringView fileNameView(int idx) const;
+    QString absolutePath(int idx) const { return m_dirs[m_dir[idx]]; }
+    // Interned folders
+    int dirIndex(int idx) const { return int(m_dir[idx]); }
+    int dirCount() const { return int(m_dirs.size()); }
+    QString const &dir(int d) const { return m_dirs[d]; }
+    QString filePath(int idx) const;
+    QByteArray hash(int idx) const { return QByteArray(m_hash[idx].data(), qsizetype(m_hash[idx].size())); }
+    bool matches(int idx, QByteArray const &hash) const;
+    qint64 filesize(int idx) const { return m_filesize[idx]; }
+    QSize imageSize(int idx) const { return m_imagesize[idx]; }
+    void setImageSize(int idx, QSize size) { m_imagesize[idx] = size; }
+    // From the file header: EXIF orientation and capture time (seconds since epoch, 0 unknown)
+    int orientation(int idx) const { return m_orientation[idx]; }
+    qint64 captured(int idx) const { return m_captured[idx]; }
+    void setMetadata(int idx, int orientation, qint64 captured);
+
+    // A WorkItem for the loader, routed back by m_idx
+    WorkItem workItem(int idx) const;
+
+    QPixmap const *thumb(int idx) const { return m_pixmaps.get(m_thumb[idx]); }
+    void setThumb(int idx, QPixmap thumb);
+    void releaseThumb(int idx);
+    // Entries holding a thumbnail and the pixel bytes of those, for the residency budget
+    QSet<int> const &residentThumbs() const { return m_resident; }
+    qint64 thumbBytes() const { return m_thumbbytes; }
+    QPixmap const *image(int idx) const { return m_pixmaps.get(m_image[idx]); }
+    void setImage(int idx, QPixmap image);
+    void releaseImage(int idx);
+
+    // Memory held per entry by the catalog itself, pixmaps excluded
+    double bytesPerEntry() const;
+
+    // The arrays a saved listing is written from. Copied whole, so taking it is a handful of
+    // allocations however many entries there are; the strings are shared, not copied.
+    struct Listing {
+        QStringList dirs;
+        QString names;
+        std::vector<quint32> dir;
+        std::vector<quint32> nameoffset;
+        std::vector<Key> hash;
+        std::vector<qint64> filesize;
+    };
+    Listing listing() const { return Listing{ m_dirs, m_names, m_dir, m_nameoffset, m_hash, m_filesize }; }
+
+private:
+    QStringList m_dirs;
+    QHash<QString, quint32> m_dirindex;
+    QString m_names;
+    std::vector<quint32> m_dir;
+    std::vector<quint32> m_nameoffset;
+    std::vector<Key> m_hash;
+    std::vector<qint64> m_filesize;
+    std::vector<QSize> m_imagesize;
+    std::vector<quint8> m_orientation;
+    std::vector<qint64> m_captured;
+    std::vector<quint32> m_thumb;
+    std::vector<quint32> m_image;
+    PixmapPool m_pixmaps;
+    QSet<int> m_resident;
+    qint64 m_thumbbytes = 0;
+};
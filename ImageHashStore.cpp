@@ -1,81 +1,423 @@
 #include "ImageHashStore.h"
 #include <QBuffer>
 #include <QDebug>
+#include <QDateTime>
 #include <QDir>
+#include <QFile>
 #include <QMutexLocker>
 #include <QSqlError>
 #include <QStandardPaths>
 
+#include "ArchiveIndex.h"
+#include "Bench.h"
+
 ImageHashStore::ImageHashStore(QObject* parent)
     : QObject(parent) {
 }
 
 ImageHashStore::~ImageHashStore() {
+    m_relay->detach();
     if (db.isOpen()) {
+        flushAccessTimes();
         db.close();
     }
 }
 
-void ImageHashStore::insertThumb(WorkItem wi, QByteArray buffer, QSize si) {
+QByteArray ImageHashStore::keyFor(QFileInfo const &fi) {
+    QString archive, member;
+    if (!fi.exists() && ArchiveIndex::split(fi.absoluteFilePath(), archive, member)) {
+        return memberKeyFor(QFileInfo(archive), member);
+    }
+    QString const textkey = QStringLiteral(u"path=%1;size=%2;time=%3")
+                                .arg(fi.absoluteFilePath())
+                                .arg(fi.size())
+                                .arg(fi.lastModified().toSecsSinceEpoch());
+    return QCryptographicHash::hash(textkey.toUtf8(), QCryptographicHash::Sha256);
+}
+
+QByteArray ImageHashStore::memberKeyFor(QFileInfo const &archive, QString const &member) {
+    // The archive's identity plus the member name, editing the archive invalidates its members
+    QString const textkey = QStringLiteral(u"path=%1;size=%2;time=%3;member=%4")
+                                .arg(archive.absoluteFilePath())
+                                .arg(archive.size())
+                                .arg(archive.lastModified().toSecsSinceEpoch())
+                                .arg(member);
+    return QCryptographicHash::hash(textkey.toUtf8(), QCryptographicHash::Sha256);
+}
+
+QByteArray ImageHashStore::fingerprintFor(QFileInfo const &fi) {
+    // Size plus the first and last 64 KB: cheap to read and stable across moves and renames
+    qint64 const constexpr chunk = 64 * 1024;
+    QFile file(fi.absoluteFilePath());
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+        return QByteArray();
+    }
+    qint64 const size = file.size();
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(QByteArray::number(size));
+    hash.addData(file.read(chunk));
+    if (size > chunk) {
+        file.seek(std::max(chunk, size - chunk));
+        hash.addData(file.read(chunk));
+    }
+    return hash.result();
+}
+
+bool ImageHashStore::adoptByFingerprint(WorkItem const &wi, QByteArray &thumbdata, QSize &si) {
+    if (wi.m_fingerprint.isEmpty()) {
+        return false;
+    }
+
+    m_get_by_fingerprint_query.bindValue(":fingerprint", wi.m_fingerprint);
+    if (!m_get_by_fingerprint_query.exec() || !m_get_by_fingerprint_query.next()) {
+        m_get_by_fingerprint_query.finish();
+        return false;
+    }
+    QByteArray const oldhash = m_get_by_fingerprint_query.value(0).toByteArray();
+    thumbdata = m_get_by_fingerprint_query.value(1).toByteArray();
+    si = QSize(m_get_by_fingerprint_query.value(2).toInt(), m_get_by_fingerprint_query.value(3).toInt());
+    QString const oldpath = m_get_by_fingerprint_query.value(4).toString();
+    m_get_by_fingerprint_query.finish();
+
+    if (oldhash == wi.m_hash) {
+        return true;
+    }
+
+    // A copy keeps its original row, a move takes it over
+    QFileInfo const oldfi(oldpath);
+    if (oldfi.exists() && keyFor(oldfi) == oldhash) {
+        QList<QByteArray> levels(ThumbLevel::sizes.size());
+        levels[ThumbLevel::index(ThumbLevel::base)] = thumbdata;
+        insertThumb(wi, levels, si);
+        return true;
+    }
+
+    m_rekey_query.bindValue(":hash", wi.m_hash);
+    m_rekey_query.bindValue(":filepath", wi.fi.filePath());
+    m_rekey_query.bindValue(":lastaccess", QDateTime::currentSecsSinceEpoch());
+    m_rekey_query.bindValue(":oldhash", oldhash);
+    if (!m_rekey_query.exec()) {
+        qWarning() << "Rekey failed:" << m_rekey_query.lastError().text();
+    }
+    qDebug() << "adopted thumb of" << oldpath << "for" << wi.fi.filePath();
+    return true;
+}
+
+bool ImageHashStore::contains(QByteArray const &hash) {
+    m_contains_query.bindValue(":hash", hash);
+    bool const found = m_contains_query.exec() && m_contains_query.next();
+    m_contains_query.finish();
+    return found;
+}
+
+void ImageHashStore::insertThumb(WorkItem wi, QList<QByteArray> levels, QSize si) {
+    QByteArray const &buffer = levels.value(ThumbLevel::index(ThumbLevel::base));
     qDebug() << "saved thumb with " << buffer.size() << "bytes";
 
+    db.transaction();
     m_insert_query.finish();
     m_insert_query.bindValue(":hash", wi.m_hash);
     m_insert_query.bindValue(":image", buffer);
     m_insert_query.bindValue(":filepath", wi.fi.filePath());
-    m_insert_query.bindValue(":filesize", static_cast<qint64>(wi.fi.size()));
+    m_insert_query.bindValue(":filesize", (wi.m_filesize >= 0) ? wi.m_filesize : static_cast<qint64>(wi.fi.size()));
     m_insert_query.bindValue(":width", static_cast<qint64>(si.width()));
     m_insert_query.bindValue(":height", static_cast<qint64>(si.height()));
+    m_insert_query.bindValue(":lastaccess", QDateTime::currentSecsSinceEpoch());
+    m_insert_query.bindValue(":fingerprint", wi.m_fingerprint);
 
     if (!m_insert_query.exec()) {
         qWarning() << "Insert failed:" << m_insert_query.lastError().text();
     }
 
-    return;
+    for (qsizetype i = 0; i < levels.size() && i < qsizetype(ThumbLevel::sizes.size()); ++i) {
+        if (ThumbLevel::sizes[i] == ThumbLevel::base || levels[i].isEmpty()) {
+            continue;
+        }
+        m_insert_level_query.bindValue(":hash", wi.m_hash);
+        m_insert_level_query.bindValue(":level", ThumbLevel::sizes[i]);
+        m_insert_level_query.bindValue(":image", levels[i]);
+        if (!m_insert_level_query.exec()) {
+            qWarning() << "Insert level failed:" << m_insert_level_query.lastError().text();
+        }
+    }
+    db.commit();
+}
+
+void ImageHashStore::requestThumbs(QList<WorkItem> wis) {
+    QList<WorkItem> found, missing;
+    QList<QByteArray> thumbs;
+    QList<QSize> sizes;
+    lookupThumbs(wis, found, thumbs, sizes, missing);
+    if (!found.isEmpty()) {
+        emit thumbsFound(found, thumbs, sizes);
+    }
+    if (!missing.isEmpty()) {
+        emit thumbsMissing(missing);
+    }
 }
 
-void ImageHashStore::requestThumb(WorkItem wi) {
-    QByteArray imgData;
-    QSize si;
-    m_get_by_hash_query.finish();
-    m_get_by_hash_query.bindValue(":hash", wi.m_hash);
-    if (m_get_by_hash_query.exec()) {
-        if (m_get_by_hash_query.next()) {
-            imgData = m_get_by_hash_query.value(0).toByteArray();
-            si.setWidth(m_get_by_hash_query.value(1).toInt());
-            si.setHeight(m_get_by_hash_query.value(2).toInt());
-            qDebug() << "imagehashstore requestthumb " << imgData.size();
+void ImageHashStore::lookupThumbs(QList<WorkItem> const &wis, QList<WorkItem> &found, QList<QByteArray> &thumbs, QList<QSize> &sizes,
+                                  QList<WorkItem> &missing) {
+    Bench::Scope const bench(QStringLiteral(u"thumbs.db.lookup"));
+    for (auto const &wi : wis) {
+        if (wi.m_cancel.isCancelled()) {
+            continue;
         }
+        m_get_by_hash_query.bindValue(":hash", wi.m_hash);
+        m_get_by_hash_query.bindValue(":level", wi.m_level);
+        if (m_get_by_hash_query.exec() && m_get_by_hash_query.next()) {
+            found.push_back(wi);
+            thumbs.push_back(m_get_by_hash_query.value(0).toByteArray());
+            sizes.push_back(QSize(m_get_by_hash_query.value(1).toInt(), m_get_by_hash_query.value(2).toInt()));
+
+            // Access times are only needed by the janitor, write them in batches
+            m_touched.insert(wi.m_hash);
+            if (!m_touch_timer->isActive()) {
+                m_touch_timer->start();
+            }
+        } else {
+            missing.push_back(wi);
+        }
+        m_get_by_hash_query.finish();
     }
-    emit thumbReady(wi, QImage(imgData), si);
+    qDebug() << "imagehashstore lookupthumbs" << found.size() << "found," << missing.size() << "missing";
 }
 
-void ImageHashStore::init() {
+void ImageHashStore::requestMetadata(QList<WorkItem> wis) {
+    QList<WorkItem> known, missing;
+    QList<ImageMetadata> mds;
+    for (auto const &wi : wis) {
+        if (wi.m_cancel.isCancelled()) {
+            return;
+        }
+        m_get_metadata_query.bindValue(":hash", wi.m_hash);
+        if (m_get_metadata_query.exec() && m_get_metadata_query.next()) {
+            ImageMetadata md;
+            QVariant const captured = m_get_metadata_query.value(0);
+            if (!captured.isNull()) {
+                md.captured = QDateTime::fromSecsSinceEpoch(captured.toLongLong());
+            }
+            md.orientation = m_get_metadata_query.value(1).toInt();
+            md.camera = m_get_metadata_query.value(2).toString();
+            md.lens = m_get_metadata_query.value(3).toString();
+            md.size = QSize(m_get_metadata_query.value(4).toInt(), m_get_metadata_query.value(5).toInt());
+            // Rows without a thumbnail are only kept while their file is listed now and then,
+            // a day is close enough for that
+            if (m_get_metadata_query.value(6).toLongLong() < QDateTime::currentSecsSinceEpoch() - 24 * 60 * 60) {
+                m_touchedmetadata.insert(wi.m_hash);
+                if (!m_touch_timer->isActive()) {
+                    m_touch_timer->start();
+                }
+            }
+            known.push_back(wi);
+            mds.push_back(std::move(md));
+        } else if (!wi.m_storeonly) {
+            missing.push_back(wi);
+        }
+        m_get_metadata_query.finish();
+    }
+    if (!known.isEmpty()) {
+        emit metadataReady(known, mds);
+    }
+    if (!missing.isEmpty()) {
+        emit metadataMissing(missing);
+    }
+}
+
+void ImageHashStore::insertMetadata(QList<WorkItem> wis, QList<ImageMetadata> mds) {
+    qint64 const now = QDateTime::currentSecsSinceEpoch();
+    db.transaction();
+    for (qsizetype i = 0; i < wis.size() && i < mds.size(); ++i) {
+        ImageMetadata const &md = mds[i];
+        m_insert_metadata_query.bindValue(":hash", wis[i].m_hash);
+        m_insert_metadata_query.bindValue(":captured", md.captured.isValid() ? QVariant(md.captured.toSecsSinceEpoch()) : QVariant());
+        m_insert_metadata_query.bindValue(":orientation", md.orientation);
+        m_insert_metadata_query.bindValue(":camera", md.camera.isEmpty() ? QVariant() : QVariant(md.camera));
+        m_insert_metadata_query.bindValue(":lens", md.lens.isEmpty() ? QVariant() : QVariant(md.lens));
+        m_insert_metadata_query.bindValue(":width", md.size.width());
+        m_insert_metadata_query.bindValue(":height", md.size.height());
+        m_insert_metadata_query.bindValue(":lastaccess", now);
+        if (!m_insert_metadata_query.exec()) {
+            qWarning() << "Insert metadata failed:" << m_insert_metadata_query.lastError().text();
+        }
+    }
+    db.commit();
+}
+
+void ImageHashStore::flushAccessTimes() {
+    if (m_touched.isEmpty() && m_touchedmetadata.isEmpty()) {
+        return;
+    }
+
+    qint64 const now = QDateTime::currentSecsSinceEpoch();
+    db.transaction();
+    for (auto const &hash : std::as_const(m_touched)) {
+        m_touch_query.bindValue(":lastaccess", now);
+        m_touch_query.bindValue(":hash", hash);
+        if (!m_touch_query.exec()) {
+            qWarning() << "Touch failed:" << m_touch_query.lastError().text();
+        }
+    }
+    for (auto const &hash : std::as_const(m_touchedmetadata)) {
+        m_touch_metadata_query.bindValue(":lastaccess", now);
+        m_touch_metadata_query.bindValue(":hash", hash);
+        if (!m_touch_metadata_query.exec()) {
+            qWarning() << "Touch metadata failed:" << m_touch_metadata_query.lastError().text();
+        }
+    }
+    db.commit();
+    m_touched.clear();
+    m_touchedmetadata.clear();
+}
+
+void ImageHashStore::setDatabasePath(QString const &filename) {
+    m_database_path = filename;
+}
+
+QString ImageHashStore::databasePath() {
+    if (!m_database_path.isEmpty()) {
+        return m_database_path;
+    }
     QString filename = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
 
     QDir().mkpath(filename);
-    filename += "/thumbs.db";
+    return filename + "/thumbs.db";
+}
+
+void ImageHashStore::init() {
+    // Lookups use the timer even when the database failed to open below
+    m_touch_timer = new QTimer(this);
+    m_touch_timer->setSingleShot(true);
+    m_touch_timer->setInterval(5000);
+    connect(m_touch_timer, &QTimer::timeout, this, &ImageHashStore::flushAccessTimes);
 
     db = QSqlDatabase::addDatabase("QSQLITE", "ImageHashStoreConnection");
-    db.setDatabaseName(filename);
+    db.setDatabaseName(databasePath());
     if (!db.open()) {
         qDebug() << db.lastError().nativeErrorCode();
         return;
     }
 
     QSqlQuery pragma(db);
+    // auto_vacuum only takes effect on a fresh file, older ones are converted by ImgViewThumbs --compact
+    pragma.exec("PRAGMA auto_vacuum=INCREMENTAL;");
     pragma.exec("PRAGMA journal_mode=WAL;");
     pragma.exec("PRAGMA synchronous=NORMAL;");
+    pragma.exec("PRAGMA busy_timeout=5000;");
 
     QSqlQuery query(db);
-    if (!query.exec("CREATE TABLE IF NOT EXISTS images (hash BLOB PRIMARY KEY, image BLOB, filepath TEXT, filesize INTEGER, width INTEGER, height INTEGER)")) {
+    if (!query.exec("CREATE TABLE IF NOT EXISTS images (hash BLOB PRIMARY KEY, image BLOB, filepath TEXT, filesize INTEGER, width INTEGER, height INTEGER, lastaccess INTEGER DEFAULT 0, fingerprint BLOB)")) {
         qWarning() << "Create table failed:" << query.lastError().text();
         return;
     }
 
+    // Databases written before access tracking or fingerprints lack these columns
+    QSet<QString> columns;
+    if (query.exec("PRAGMA table_info(images)")) {
+        while (query.next()) {
+            columns.insert(query.value(1).toString());
+        }
+    }
+    if (!columns.contains("lastaccess") && !query.exec("ALTER TABLE images ADD COLUMN lastaccess INTEGER DEFAULT 0")) {
+        qWarning() << "Add column failed:" << query.lastError().text();
+    }
+    if (!columns.contains("fingerprint") && !query.exec("ALTER TABLE images ADD COLUMN fingerprint BLOB")) {
+        qWarning() << "Add column failed:" << query.lastError().text();
+    }
+
+    if (!query.exec("CREATE INDEX IF NOT EXISTS images_lastaccess ON images (lastaccess)")) {
+        qWarning() << "Create index failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE INDEX IF NOT EXISTS images_fingerprint ON images (fingerprint)")) {
+        qWarning() << "Create index failed:" << query.lastError().text();
+    }
+
+    // Thumbnail levels other than the base one, see ThumbLevel. They follow their images row
+    // when it is deleted or re-keyed.
+    if (!query.exec("CREATE TABLE IF NOT EXISTS thumbs (hash BLOB, level INTEGER, image BLOB, PRIMARY KEY (hash, level)) WITHOUT ROWID")) {
+        qWarning() << "Create table failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE TRIGGER IF NOT EXISTS images_delete_levels AFTER DELETE ON images "
+                    "BEGIN DELETE FROM thumbs WHERE hash = old.hash; END")) {
+        qWarning() << "Create trigger failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE TRIGGER IF NOT EXISTS images_rekey_levels AFTER UPDATE OF hash ON images "
+                    "BEGIN UPDATE OR REPLACE thumbs SET hash = new.hash WHERE hash = old.hash; END")) {
+        qWarning() << "Create trigger failed:" << query.lastError().text();
+    }
+
+    // Header metadata, written when a file is first listed and so independent of the images
+    // row. Indexed for browsing by date and by camera. It is dropped along with the images
+    // row, which only means the header is read again; rows without one are dropped by the
+    // janitor once their file has not been listed for a while.
+    if (!query.exec("CREATE TABLE IF NOT EXISTS metadata (hash BLOB PRIMARY KEY, captured INTEGER, orientation INTEGER, "
+                    "camera TEXT, lens TEXT, width INTEGER, height INTEGER, lastaccess INTEGER DEFAULT 0) WITHOUT ROWID")) {
+        qWarning() << "Create table failed:" << query.lastError().text();
+    }
+    QSet<QString> metadatacolumns;
+    if (query.exec("PRAGMA table_info(metadata)")) {
+        while (query.next()) {
+            metadatacolumns.insert(query.value(1).toString());
+        }
+    }
+    if (!metadatacolumns.contains("lastaccess")) {
+        // Existing rows count as listed now, so they get the full grace period
+        if (!query.exec("ALTER TABLE metadata ADD COLUMN lastaccess INTEGER DEFAULT 0") ||
+            !query.exec(QStringLiteral(u"UPDATE metadata SET lastaccess = %1").arg(QDateTime::currentSecsSinceEpoch()))) {
+            qWarning() << "Add column failed:" << query.lastError().text();
+        }
+    }
+    if (!query.exec("CREATE INDEX IF NOT EXISTS metadata_captured ON metadata (captured)")) {
+        qWarning() << "Create index failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE INDEX IF NOT EXISTS metadata_camera ON metadata (camera, lens)")) {
+        qWarning() << "Create index failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE TRIGGER IF NOT EXISTS images_delete_metadata AFTER DELETE ON images "
+                    "BEGIN DELETE FROM metadata WHERE hash = old.hash; END")) {
+        qWarning() << "Create trigger failed:" << query.lastError().text();
+    }
+    if (!query.exec("CREATE TRIGGER IF NOT EXISTS images_rekey_metadata AFTER UPDATE OF hash ON images "
+                    "BEGIN UPDATE OR REPLACE metadata SET hash = new.hash WHERE hash = old.hash; END")) {
+        qWarning() << "Create trigger failed:" << query.lastError().text();
+    }
+
+    // The catalog browser pages through the table ordered by path
+    if (!query.exec("CREATE INDEX IF NOT EXISTS images_filepath ON images (filepath, hash)")) {
+        qWarning() << "Create index failed:" << query.lastError().text();
+    }
+
+    m_insert_level_query = QSqlQuery(db);
+    m_insert_level_query.prepare("INSERT OR REPLACE INTO thumbs (hash, level, image) VALUES (:hash, :level, :image)");
+
     m_insert_query = QSqlQuery(db);
-    m_insert_query.prepare("INSERT OR REPLACE INTO images VALUES (:hash, :image, :filepath, :filesize, :width, :height)");
+    m_insert_query.prepare("INSERT OR REPLACE INTO images (hash, image, filepath, filesize, width, height, lastaccess, fingerprint) "
+                           "VALUES (:hash, :image, :filepath, :filesize, :width, :height, :lastaccess, :fingerprint)");
 
     m_get_by_hash_query = QSqlQuery(db);
-    m_get_by_hash_query.prepare(QStringLiteral(u"SELECT image, width, height FROM images WHERE hash = :hash"));
+    m_get_by_hash_query.prepare(QStringLiteral(u"SELECT COALESCE(thumbs.image, images.image), width, height FROM images "
+                                                "LEFT JOIN thumbs ON thumbs.hash = images.hash AND thumbs.level = :level "
+                                                "WHERE images.hash = :hash"));
+
+    m_touch_query = QSqlQuery(db);
+    m_touch_query.prepare(QStringLiteral(u"UPDATE images SET lastaccess = :lastaccess WHERE hash = :hash"));
+
+    m_get_by_fingerprint_query = QSqlQuery(db);
+    m_get_by_fingerprint_query.prepare(QStringLiteral(u"SELECT hash, image, width, height, filepath FROM images WHERE fingerprint = :fingerprint LIMIT 1"));
+
+    m_contains_query = QSqlQuery(db);
+    m_contains_query.prepare(QStringLiteral(u"SELECT 1 FROM images WHERE hash = :hash"));
+
+    m_rekey_query = QSqlQuery(db);
+    m_rekey_query.prepare(QStringLiteral(u"UPDATE OR REPLACE images SET hash = :hash, filepath = :filepath, lastaccess = :lastaccess WHERE hash = :oldhash"));
+
+    m_get_metadata_query = QSqlQuery(db);
+    m_get_metadata_query.prepare(QStringLiteral(u"SELECT captured, orientation, camera, lens, width, height, lastaccess FROM metadata WHERE hash = :hash"));
+
+    m_insert_metadata_query = QSqlQuery(db);
+    m_insert_metadata_query.prepare(QStringLiteral(u"INSERT OR REPLACE INTO metadata (hash, captured, orientation, camera, lens, width, height, lastaccess) "
+                                                   "VALUES (:hash, :captured, :orientation, :camera, :lens, :width, :height, :lastaccess)"));
+
+    m_touch_metadata_query = QSqlQuery(db);
+    m_touch_metadata_query.prepare(QStringLiteral(u"UPDATE metadata SET lastaccess = :lastaccess WHERE hash = :hash"));
 }
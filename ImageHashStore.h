@@ -4,8 +4,12 @@
 #include <QSqlDatabase>
 #include <QBuffer>
 #include <QMutex>
+#include <QSet>
 #include <QSqlQuery>
+#include <QTimer>
 
+#include "ImageMetadata.h"
+#include "Relay.h"
 #include "WorkItem.h"
 
 class ImageHashStore : public QObject{
@@ -14,15 +18,50 @@ public:
     explicit ImageHashStore(QObject* parent = nullptr);
     ~ImageHashStore();
 
+    static QString databasePath();
+    static void setDatabasePath(QString const &filename);
+    static QByteArray keyFor(QFileInfo const &fi);
+    static QByteArray memberKeyFor(QFileInfo const &archive, QString const &member);
+    static QByteArray fingerprintFor(QFileInfo const &fi);
+
+    // Secondary lookup for files that were moved or renamed since their thumbnail was stored.
+    // On a hit the row is re-keyed to wi (or copied if the old file is still in place).
+    bool adoptByFingerprint(WorkItem const &wi, QByteArray &thumbdata, QSize &si);
+    bool contains(QByteArray const &hash);
+    // The lookup behind requestThumbs, for callers already on the store's thread
+    void lookupThumbs(QList<WorkItem> const &wis, QList<WorkItem> &found, QList<QByteArray> &thumbs, QList<QSize> &sizes,
+                      QList<WorkItem> &missing);
+    // Lets pool jobs call into the store without holding on to it; detached at shutdown
+    std::shared_ptr<Relay<ImageHashStore>> relay() const { return m_relay; }
+
 public slots:
-    void insertThumb(WorkItem wi, QByteArray thumbdata, QSize si);
-    void requestThumb(WorkItem wi);
+    // One encoded thumbnail per ThumbLevel::sizes entry, empty ones are skipped
+    void insertThumb(WorkItem wi, QList<QByteArray> levels, QSize si);
+    // Looks up a batch and answers with thumbsFound for the stored ones, still encoded so
+    // they are decoded off this thread, and thumbsMissing for the rest
+    void requestThumbs(QList<WorkItem> wis);
+    // Answers with metadataReady for the known files and metadataMissing for the rest,
+    // except for store-only items which are not read from their files
+    void requestMetadata(QList<WorkItem> wis);
+    void insertMetadata(QList<WorkItem> wis, QList<ImageMetadata> mds);
     void init();
 
 signals:
-    void thumbReady(WorkItem wi, QImage thumb, QSize si);
+    void thumbsFound(QList<WorkItem> wis, QList<QByteArray> thumbs, QList<QSize> sizes);
+    void thumbsMissing(QList<WorkItem> wis);
+    void metadataReady(QList<WorkItem> wis, QList<ImageMetadata> mds);
+    void metadataMissing(QList<WorkItem> wis);
 
 private:
+    void flushAccessTimes();
+
     QSqlDatabase db;
-    QSqlQuery m_insert_query, m_get_by_hash_query;
+    QSqlQuery m_insert_query, m_insert_level_query, m_get_by_hash_query, m_touch_query;
+    QSqlQuery m_get_by_fingerprint_query, m_rekey_query, m_contains_query;
+    QSqlQuery m_get_metadata_query, m_insert_metadata_query, m_touch_metadata_query;
+    static inline QString m_database_path;
+    QSet<QByteArray> m_touched;
+    QSet<QByteArray> m_touchedmetadata;
+    QTimer *m_touch_timer = nullptr;
+    std::shared_ptr<Relay<ImageHashStore>> m_relay = std::make_shared<Relay<ImageHashStore>>(this);
 };
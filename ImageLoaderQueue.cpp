@@ -1,44 +1,212 @@
 #include "ImageLoaderQueue.h"
+#include <QDeadlineTimer>
 #include <QThread>
-#include <QThreadPool>
+#include <QTimer>
+#include "Bench.h"
 #include "ImageHashStore.h"
-#include "ImageItem.h"
 #include "ImageLoaderTask.h"
+#include "ImagePipeline.h"
+#include "ParallelImage.h"
+#include "ThumbCacheJanitor.h"
 #include "WorkItem.h"
 #include "qstringview.h"
 
-ImageLoaderQueue::ImageLoaderQueue() {
+ImageLoaderQueue::ImageLoaderQueue()
+    : m_relay(std::make_shared<Relay<ImageLoaderQueue>>(this)) {
     m_imagehashstore = new ImageHashStore;
     QThread *dbThread = new QThread;
+    m_dbthread = dbThread;
     m_imagehashstore->moveToThread(dbThread);
 
     QObject::connect(dbThread, &QThread::started, m_imagehashstore, &ImageHashStore::init);
     QObject::connect(dbThread, &QThread::finished, m_imagehashstore, &QObject::deleteLater);
-    QObject::connect(this, &ImageLoaderQueue::requestThumbFromDatabase, m_imagehashstore, &ImageHashStore::requestThumb);
+    QObject::connect(this, &ImageLoaderQueue::requestThumbsFromDatabase, m_imagehashstore, &ImageHashStore::requestThumbs);
+    QObject::connect(m_imagehashstore, &ImageHashStore::thumbsFound, this, &ImageLoaderQueue::decodeThumbs);
+    QObject::connect(m_imagehashstore, &ImageHashStore::thumbsMissing, this, [this](QList<WorkItem> wis) {
+        for (auto const &wi : wis) {
+            setThumbFromDatabase(wi, QImage(), QSize());
+        }
+    });
+    QObject::connect(this, &ImageLoaderQueue::requestMetadataFromDatabase, m_imagehashstore, &ImageHashStore::requestMetadata);
+    QObject::connect(m_imagehashstore, &ImageHashStore::metadataReady, this, &ImageLoaderQueue::metadataReady);
+    QObject::connect(m_imagehashstore, &ImageHashStore::metadataMissing, this, &ImageLoaderQueue::readMetadata);
     dbThread->start();
+
+    ThumbCacheJanitor *janitor = new ThumbCacheJanitor;
+    QThread *janitorThread = new QThread;
+    m_janitorthread = janitorThread;
+    janitor->moveToThread(janitorThread);
+    QObject::connect(janitorThread, &QThread::started, janitor, &ThumbCacheJanitor::init);
+    QObject::connect(janitorThread, &QThread::finished, janitor, &QObject::deleteLater);
+    janitorThread->start(QThread::LowestPriority);
+}
+
+ImageLoaderQueue::~ImageLoaderQueue() {
+    m_relay->detach();
+}
+
+void ImageLoaderQueue::shutdown(int msecs) {
+    QDeadlineTimer const deadline(msecs);
+    cancel();
+    m_relay->detach();
+    // The janitor stops between batches, the store quits after the inserts queued before
+    // this; cancelled lookups in the queue return right away, fingerprint lookups are dropped
+    m_janitorthread->requestInterruption();
+    m_janitorthread->quit();
+    QMetaObject::invokeMethod(m_imagehashstore, [store = m_imagehashstore, thread = m_dbthread]() {
+        store->relay()->detach();
+        thread->quit();
+    }, Qt::QueuedConnection);
+    if (!m_dbthread->wait(deadline)) {
+        qWarning() << "thumbnail database still busy, remaining writes are dropped";
+    }
+    m_janitorthread->wait(deadline);
 }
 
 void ImageLoaderQueue::insert(WorkItem wi) {
+    wi.m_cancel = m_cancel.token(wi.m_cancel);
     qDebug() << "imageloaderqueue insert " << wi.fi.fileName();
     if (wi.loadimage) {
-        requestImage(wi);
+        startTask(wi);
     } else if (wi.loadthumb) {
-        emit requestThumbFromDatabase(wi);
+        if (m_thumbrequests.isEmpty()) {
+            QTimer::singleShot(0, this, &ImageLoaderQueue::flushThumbRequests);
+        }
+        m_thumbrequests.push_back(wi);
+    }
+}
+
+void ImageLoaderQueue::flushThumbRequests() {
+    if (!m_thumbrequests.isEmpty()) {
+        emit requestThumbsFromDatabase(std::exchange(m_thumbrequests, QList<WorkItem>()));
+    }
+}
+
+void ImageLoaderQueue::decodeThumbs(QList<WorkItem> wis, QList<QByteArray> thumbs, QList<QSize> sizes) {
+    // The database thread only looks up, the blobs are decoded by the decode stage a few
+    // at a time so a screenful of thumbnails spreads over all its workers. Visible cells and
+    // prefetched ones go in separate chunks, each chunk runs at the priority of its items.
+    qsizetype const constexpr chunk = 8;
+    for (bool const prefetch : { false, true }) {
+        QList<qsizetype> picked;
+        for (qsizetype i = 0; i < wis.size(); ++i) {
+            if (wis[i].m_prefetch == prefetch) {
+                picked.push_back(i);
+            }
+        }
+        for (qsizetype begin = 0; begin < picked.size(); begin += chunk) {
+            QList<WorkItem> part;
+            QList<QByteArray> data;
+            QList<QSize> si;
+            for (qsizetype const i : picked.mid(begin, chunk)) {
+                part.push_back(wis[i]);
+                data.push_back(thumbs[i]);
+                si.push_back(sizes[i]);
+            }
+            // Items of one chunk may come from different regions of the grid and be cancelled
+            // one by one, only the cancelled ones are skipped
+            ImagePipeline::instance().decode.submit([relay = m_relay, token = m_cancel.token(), part, data, si]() {
+                QList<WorkItem> done;
+                QList<QImage> images;
+                QList<QSize> donesi;
+                for (qsizetype i = 0; i < part.size(); ++i) {
+                    if (part[i].m_cancel.isCancelled()) {
+                        continue;
+                    }
+                    Bench::Scope const bench(QStringLiteral(u"thumbs.db.decode"));
+                    // Rows written before a level existed fall back to the base level, scale
+                    // that down if it is too large; one that is too small is regenerated
+                    QImage thumb = QImage::fromData(data[i]);
+                    if (ThumbLevel::extent(thumb.size()) > part[i].m_level) {
+                        thumb = thumb.scaled(part[i].m_level, part[i].m_level, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+                    }
+                    done.push_back(part[i]);
+                    images.push_back(ParallelImage::displayReady(thumb));
+                    donesi.push_back(si[i]);
+                }
+                if (done.isEmpty()) {
+                    return;
+                }
+                Relay<ImageLoaderQueue>::deliver(relay, token, [done, images, donesi](ImageLoaderQueue *queue) {
+                    for (qsizetype i = 0; i < done.size(); ++i) {
+                        queue->setThumbFromDatabase(done[i], images[i], donesi[i]);
+                    }
+                });
+            }, prefetch ? ImagePipeline::prefetch : ImagePipeline::thumbnail);
+        }
     }
 }
 
 void ImageLoaderQueue::setThumbFromDatabase(WorkItem wi, QImage thumb, QSize si) {
+    if (wi.m_cancel.isCancelled()) {
+        return;
+    }
+    Bench::count(thumb.isNull() ? QStringLiteral(u"cache.thumb.miss") : QStringLiteral(u"cache.thumb.hit"));
     if (!thumb.isNull()) {
         emit requestReady(wi, QImage(), thumb, si);
     }
 
-    requestImage(wi);
+    // Not cached, or cached before the wanted level existed: generate from the file. A
+    // store-only item keeps whatever level the database has.
+    if (wi.m_storeonly) {
+        return;
+    }
+    int const extent = ThumbLevel::extent(thumb.size());
+    if (thumb.isNull() || (extent < wi.m_level && ThumbLevel::extent(si) > extent)) {
+        wi.m_keymissed = thumb.isNull();
+        startTask(wi);
+    }
+}
+
+void ImageLoaderQueue::requestMetadata(QList<WorkItem> wis) {
+    for (auto &wi : wis) {
+        wi.m_cancel = m_cancel.token();
+    }
+    if (!wis.isEmpty()) {
+        emit requestMetadataFromDatabase(wis);
+    }
+}
+
+void ImageLoaderQueue::readMetadata(QList<WorkItem> wis) {
+    // Only the headers are read, so a job covers a few files; the readers work through
+    // the jobs in parallel while the directory is still being listed
+    qsizetype const constexpr chunk = 32;
+    for (qsizetype begin = 0; begin < wis.size(); begin += chunk) {
+        ImagePipeline::instance().read.submit([relay = m_relay, part = wis.mid(begin, chunk)]() {
+            QList<WorkItem> done;
+            QList<ImageMetadata> mds;
+            for (auto const &wi : part) {
+                if (wi.m_cancel.isCancelled()) {
+                    break;
+                }
+                QString error;
+                ImageMetadata md = ImageMetadata::read(wi.fi.absoluteFilePath(), error);
+                if (error.isEmpty()) {
+                    done.push_back(wi);
+                    mds.push_back(std::move(md));
+                }
+            }
+            if (done.isEmpty()) {
+                return;
+            }
+            Relay<ImageLoaderQueue>::deliver(relay, done.front().m_cancel, [done, mds](ImageLoaderQueue *queue) {
+                QMetaObject::invokeMethod(queue->m_imagehashstore, [store = queue->m_imagehashstore, done, mds]() { store->insertMetadata(done, mds); },
+                                          Qt::QueuedConnection);
+                emit queue->metadataReady(done, mds);
+            });
+        }, ImagePipeline::thumbnail);
+    }
 }
 
 void ImageLoaderQueue::requestImage(WorkItem wi) {
-    ImageLoaderTask *ilt = new ImageLoaderTask(wi);
+    wi.m_cancel = m_cancel.token(wi.m_cancel);
+    startTask(wi);
+}
+
+void ImageLoaderQueue::startTask(WorkItem wi) {
+    ImageLoaderTask *ilt = new ImageLoaderTask(wi, m_imagehashstore);
     connect(ilt, &ImageLoaderTask::loaded, this, [this](WorkItem wi, QImage img, QImage thumb, QSize si) { emit requestReady(wi, img, thumb, si); }, Qt::QueuedConnection);
     connect(ilt, &ImageLoaderTask::loadedThumbData, m_imagehashstore, &ImageHashStore::insertThumb, Qt::QueuedConnection);
 
-    QThreadPool::globalInstance()->start(ilt);
+    ilt->start();
 }
@@ -1,6 +1,10 @@
 #include <QObject>
+#include <QThread>
+#include <functional>
+#include <memory>
 
 #include "ImageHashStore.h"
+#include "Relay.h"
 #include "WorkItem.h"
 #include "qmutex.h"
 
@@ -8,17 +12,45 @@ class ImageLoaderQueue : public QObject {
     Q_OBJECT
 public:
     ImageLoaderQueue();
+    ~ImageLoaderQueue();
+
+    // Requests are tagged with the current generation; cancel() drops everything requested
+    // so far, queued work returns as soon as it is picked up
+    CancelToken token() const { return m_cancel.token(); }
+    void cancel() { m_cancel.cancel(); }
+    // Cancels everything and gives the database thread up to msecs to write what is queued
+    void shutdown(int msecs);
+    // Lives on the database thread, only call it through queued invocations
+    ImageHashStore *store() const { return m_imagehashstore; }
+    // The request keeps the token it carries as parent, so the caller can cancel it too
     void insert(WorkItem wi);
     void requestImage(WorkItem wi);
     void setThumbFromDatabase(WorkItem wi, QImage thumb, QSize si);
+    // Thumbnails found in the database, decoded in parallel on the decode stage
+    void decodeThumbs(QList<WorkItem> wis, QList<QByteArray> thumbs, QList<QSize> sizes);
+    // Header metadata of freshly listed files: from the database, or read in parallel
+    void requestMetadata(QList<WorkItem> wis);
+    void readMetadata(QList<WorkItem> wis);
 
 signals:
-    void requestThumbFromDatabase(WorkItem wi);
+    void requestThumbsFromDatabase(QList<WorkItem> wis);
+    void requestMetadataFromDatabase(QList<WorkItem> wis);
     void requestReady(WorkItem wi, QImage image, QImage thumb, QSize si);
+    void metadataReady(QList<WorkItem> wis, QList<ImageMetadata> mds);
 
 private:
+    void flushThumbRequests();
+    void startTask(WorkItem wi);
+
     QMutex m_set_mutex;
+    // Thumbnail lookups of one event loop pass, sent to the database as one batch
+    QList<WorkItem> m_thumbrequests;
     int m_num_running = 0;
     QByteArray generatehash(QFileInfo const fi);
     ImageHashStore *m_imagehashstore = nullptr;
+    QThread *m_dbthread = nullptr;
+    QThread *m_janitorthread = nullptr;
+    CancelSource m_cancel;
+    // Pool jobs hand their results back through it, shutdown() and the destructor detach it
+    std::shared_ptr<Relay<ImageLoaderQueue>> m_relay;
 };
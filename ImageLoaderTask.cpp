@@ -4,15 +4,25 @@
 #include <QFileInfo>
 #include <QImageReader>
 #include <QPixmap>
-#include <QThreadPool>
+#include <QSemaphore>
 
+#include "ArchiveIndex.h"
+#include "Bench.h"
+#include "CancellableBuffer.h"
 #include "ImageLoaderTask.h"
+#include "ImagePipeline.h"
+#include "ParallelImage.h"
 #include "WorkItem.h"
 #include "qstringview.h"
 
 void ImageLoaderTask::readImageData(QString const filename,
                                     QByteArray &imageData) {
     if (imageData.isEmpty()) {
+        QString archive, member;
+        if (ArchiveIndex::split(filename, archive, member)) {
+            ArchiveIndex::read(archive, member, imageData, m_imageinfo.m_error_message);
+            return;
+        }
         QFile file(filename);
         if (file.open(QIODevice::ReadOnly)) {
             imageData = file.readAll();
@@ -25,51 +35,214 @@ void ImageLoaderTask::readImageData(QString const filename,
 
 void ImageLoaderTask::readImage(QByteArray &imageData, QImage &image) {
     if (image.isNull()) {
-        QBuffer buffer(&imageData);
-        buffer.open(QIODevice::ReadOnly);
-        QImageReader reader(&buffer);
-        if (!reader.read(&image)) {
-            m_imageinfo.m_error_message = reader.errorString();
+        Bench::Scope const bench(QStringLiteral(u"decode.full"));
+        ParallelImage::decode(imageData, image, m_imageinfo.m_error_message, m_imageinfo.m_cancel);
+    }
+}
+
+bool ImageLoaderTask::adoptThumb(QImage &thumb, QSize &si) {
+    if (!m_store) {
+        return false;
+    }
+
+    // The primary key missed; maybe the file was only moved or renamed
+    m_imageinfo.m_fingerprint = ImageHashStore::fingerprintFor(m_imageinfo.fi);
+    struct Answer {
+        QSemaphore done;
+        bool found = false;
+        QByteArray thumbdata;
+        QSize si;
+    };
+    auto const answer = std::make_shared<Answer>();
+    auto const ask = [answer, wi = m_imageinfo](ImageHashStore *store) {
+        answer->found = store->adoptByFingerprint(wi, answer->thumbdata, answer->si);
+        answer->done.release();
+    };
+    if (!Relay<ImageHashStore>::deliver(m_store, m_imageinfo.m_cancel, ask)) {
+        return false;
+    }
+    // A store shut down in the meantime drops the lookup instead of answering it
+    while (!answer->done.tryAcquire(1, 50)) {
+        if (m_imageinfo.m_cancel.isCancelled() || !m_store->attached()) {
+            return false;
         }
     }
+    si = answer->si;
+    if (answer->found) {
+        thumb = QImage::fromData(answer->thumbdata);
+    }
+    // Only the base level moves along, a request for a larger one still needs the file
+    if (ThumbLevel::extent(thumb.size()) < std::min(m_imageinfo.m_level, ThumbLevel::extent(si))) {
+        thumb = QImage();
+    }
+    return !thumb.isNull();
 }
 
-void ImageLoaderTask::run() {
-    QImage image, thumb;
-    QSize si;
-    QByteArray imageData;
+int ImageLoaderTask::priority() const {
+    if (m_imageinfo.loadimage) {
+        return ImagePipeline::image;
+    }
+    return m_imageinfo.m_prefetch ? ImagePipeline::prefetch : ImagePipeline::thumbnail;
+}
 
+void ImageLoaderTask::start() {
+    ImagePipeline::instance().read.submit([this]() { read(); }, priority());
+}
+
+void ImageLoaderTask::read() {
+    if (abandoned()) {
+        return;
+    }
     qDebug() << "reading " << m_imageinfo.fi.fileName();
 
+    // A preview request is on the startup path, it does not wait for the store
+    if (m_imageinfo.loadthumb && m_imageinfo.m_keymissed && !m_imageinfo.m_previewsize.isValid() && adoptThumb(m_thumb, m_size)) {
+        m_imageinfo.loadthumb = false;
+    }
+    if (m_imageinfo.loadimage || m_imageinfo.loadthumb) {
+        readImageData(m_imageinfo.fi.absoluteFilePath(), m_imagedata);
+    }
+    if (m_imagedata.isEmpty()) {
+        finish();
+        return;
+    }
+
+    ImagePipeline::instance().decode.submit([this]() { decode(); }, priority());
+}
+
+void ImageLoaderTask::decodePreview() {
+    QBuffer buffer(&m_imagedata);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+    reader.setAutoTransform(false);
+    // Only formats that decode at reduced size natively (JPEG) are faster than the full decode
+    if (!reader.supportsOption(QImageIOHandler::ScaledSize)) {
+        return;
+    }
+    QSize const si = reader.size();
+    QSize const previewsize = si.scaled(m_imageinfo.m_previewsize, Qt::KeepAspectRatio);
+    if (!si.isValid() || previewsize.width() >= si.width()) {
+        return;
+    }
+    reader.setScaledSize(previewsize);
+    QImage const preview = reader.read();
+    if (!preview.isNull()) {
+        emit loaded(m_imageinfo, QImage(), ParallelImage::displayReady(preview), si);
+    }
+}
+
+bool ImageLoaderTask::isAnimated() {
+    QBuffer buffer(&m_imagedata);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+    return reader.supportsAnimation() && reader.imageCount() > 1;
+}
+
+void ImageLoaderTask::decode() {
+    if (abandoned()) {
+        return;
+    }
     if (m_imageinfo.loadimage) {
-        image = QImage(m_imageinfo.fi.absoluteFilePath());
-        si = image.size();
+        // The first frame is decoded as usual, the view plays the rest with an AnimationPlayer
+        m_imageinfo.m_animated = isAnimated();
+        if (m_imageinfo.m_previewsize.isValid()) {
+            decodePreview();
+        }
+        readImage(m_imagedata, m_image);
+        if (abandoned()) {
+            return;
+        }
+        m_size = m_image.size();
+        // Anything else would be converted single threaded in QPixmap::fromImage on the GUI thread
+        m_image = ParallelImage::displayReady(m_image);
+    } else {
+        CancellableBuffer buffer(m_imagedata, m_imageinfo.m_cancel);
+        QImageReader reader(&buffer);
+        reader.setAutoTransform(false);
+        m_size = reader.size();
+        // Decode at the largest level, the smaller ones are scaled from it
+        int const maxlevel = ThumbLevel::sizes.back();
+        if (ThumbLevel::extent(m_size) > maxlevel) {
+            reader.setScaledSize(m_size.scaled(maxlevel, maxlevel, Qt::KeepAspectRatio));
+        }
+        m_thumb = reader.read();
+        if (m_thumb.isNull()) {
+            m_imageinfo.m_error_message = reader.errorString();
+        }
     }
+    m_imagedata = QByteArray();
 
-    if (m_imageinfo.loadthumb) {
-        if (image.isNull()) {
-            QImageReader reader(m_imageinfo.fi.absoluteFilePath());
-            si = reader.size();
-            QSize scaledSize = (std::max(reader.size().width(), reader.size().height()) < 256) ? reader.size() : QSize(256, 256);
-            reader.setScaledSize(scaledSize);
-            thumb = reader.read();
-        } else {
-            int const maxsize = 256;
-            int const imgsize = std::max(image.width(), image.height());
-            thumb = (imgsize <= maxsize) ? image : image.scaled(QSize(maxsize, maxsize), Qt::KeepAspectRatio, Qt::FastTransformation);
+    if (!m_imageinfo.loadthumb || (m_image.isNull() && m_thumb.isNull())) {
+        finish();
+        return;
+    }
+
+    if (m_imageinfo.loadimage) {
+        // Show the image now, the thumbnail follows from the encode stage
+        emit loaded(m_imageinfo, m_image, QImage(), m_size);
+        m_imageinfo.loadimage = false;
+    }
+    ImagePipeline::instance().encode.submit([this]() { encode(); }, priority());
+}
+
+void ImageLoaderTask::encode() {
+    if (abandoned()) {
+        return;
+    }
+    // Every level is scaled from the next larger one, only the first step reads the full image
+    QImage level = m_thumb.isNull() ? m_image : m_thumb;
+    m_image = QImage();
+    m_thumb = QImage();
+
+    // One slot per level, empty where a level is not stored. That is up to five WebP encodes
+    // per image; the 512 level alone has three quarters of the pixels, so all levels together
+    // cost about 1.3 times the 512 encode, or some five times the single 256 px thumbnail.
+    QList<QByteArray> levels(ThumbLevel::sizes.size());
+    qsizetype const top = ThumbLevel::sizes.size() - 1;
+    for (qsizetype i = top; i >= 0; --i) {
+        int const s = ThumbLevel::sizes[i];
+        int const extent = ThumbLevel::extent(level.size());
+        if (extent > s) {
+            level = (i == top) ? ParallelImage::scaled(level, QSize(s, s), Qt::FastTransformation)
+                               : level.scaled(s, s, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+        } else if (s != ThumbLevel::base && i > 0 && extent <= ThumbLevel::sizes[i - 1]) {
+            // The image is smaller than this level and the next one down covers it too
+            continue;
         }
 
-        QByteArray buffer;
-        QBuffer qbuffer(&buffer);
+        QBuffer qbuffer(&levels[i]);
         qbuffer.open(QIODevice::WriteOnly);
-        thumb.save(&qbuffer, "WEBP", 80);
-        emit loadedThumbData(m_imageinfo, std::move(buffer), si);
+        level.save(&qbuffer, "WEBP", 80);
+
+        // Hand the smallest level covering the request to the view
+        if (s >= m_imageinfo.m_level || m_thumb.isNull()) {
+            m_thumb = level;
+        }
     }
+    emit loadedThumbData(m_imageinfo, std::move(levels), m_size);
 
-    emit loaded(m_imageinfo, std::move(image), std::move(thumb), si);
+    finish();
+}
+
+void ImageLoaderTask::finish() {
+    if (ThumbLevel::extent(m_thumb.size()) > m_imageinfo.m_level) {
+        m_thumb = m_thumb.scaled(m_imageinfo.m_level, m_imageinfo.m_level, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
+    m_thumb = ParallelImage::displayReady(m_thumb);
+    emit loaded(m_imageinfo, m_imageinfo.loadimage ? std::move(m_image) : QImage(), std::move(m_thumb), m_size);
+    delete this;
+}
+
+bool ImageLoaderTask::abandoned() {
+    // Nobody waits for the result any more, drop it between stages
+    if (!m_imageinfo.m_cancel.isCancelled()) {
+        return false;
+    }
+    delete this;
+    return true;
 }
 
-ImageLoaderTask::ImageLoaderTask(WorkItem info) {
-    setAutoDelete(true);
+ImageLoaderTask::ImageLoaderTask(WorkItem info, ImageHashStore *store)
+    : m_store(store ? store->relay() : nullptr) {
     m_imageinfo = info;
 }
@@ -4,30 +4,46 @@
 #include <QImageReader>
 #include <QMutex>
 #include <QPixmap>
-#include <QRunnable>
 
 #include <QSet>
 #include <qobject.h>
 
 #include "ImageHashStore.h"
+#include "Relay.h"
 #include "WorkItem.h"
 
-class ImageLoaderTask : public QObject, public QRunnable {
+// Loads one WorkItem by hopping through the stages of the ImagePipeline:
+// read the file bytes, decode them, then scale and encode the thumbnail.
+// The task deletes itself after its last stage.
+class ImageLoaderTask : public QObject {
   Q_OBJECT
 
  public:
-  ImageLoaderTask(WorkItem wi);
+  ImageLoaderTask(WorkItem wi, ImageHashStore *store = nullptr);
   static int runningCount();
 
-  void run() override;
+  void start();
 
 private:
+  void read();
+  void decode();
+  void decodePreview();
+  bool isAnimated();
+  void encode();
+  void finish();
+  bool abandoned();
+  int priority() const;
   void readImageData(QString const filename, QByteArray &imageData);
   void readImage(QByteArray &imageData, QImage &image);
+  bool adoptThumb(QImage &thumb, QSize &si);
 
   WorkItem m_imageinfo;
+  std::shared_ptr<Relay<ImageHashStore>> m_store;
+  QByteArray m_imagedata;
+  QImage m_image, m_thumb;
+  QSize m_size;
 
 signals:
     void loaded(WorkItem wi, QImage img, QImage thumb, QSize si);
-    void loadedThumbData(WorkItem wi, QByteArray thumbdata, QSize si);
+    void loadedThumbData(WorkItem wi, QList<QByteArray> levels, QSize si);
 };
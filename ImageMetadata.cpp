@@ -0,0 +1,236 @@
+#include "ImageMetadata.h"
+#include <QFile>
+#include <QImageReader>
+#include <QtEndian>
+
+namespace {
+// EXIF usually sits in the first 64 KB, TIFF IFDs close to the start of the file
+qint64 const constexpr headsize = 256 * 1024;
+
+// Bounds checked reads from a TIFF structure in either byte order
+class TiffReader {
+public:
+    explicit TiffReader(QByteArray const &data)
+        : m_data(data) {
+        m_little = data.startsWith("II");
+    }
+
+    bool valid() const {
+        return m_data.size() >= 8 && (m_data.startsWith("II") || m_data.startsWith("MM")) && u16(2) == 42;
+    }
+
+    quint16 u16(qint64 offset) const {
+        if (offset < 0 || offset + 2 > m_data.size()) {
+            return 0;
+        }
+        auto const *p = reinterpret_cast<uchar const *>(m_data.constData() + offset);
+        return m_little ? qFromLittleEndian<quint16>(p) : qFromBigEndian<quint16>(p);
+    }
+
+    quint32 u32(qint64 offset) const {
+        if (offset < 0 || offset + 4 > m_data.size()) {
+            return 0;
+        }
+        auto const *p = reinterpret_cast<uchar const *>(m_data.constData() + offset);
+        return m_little ? qFromLittleEndian<quint32>(p) : qFromBigEndian<quint32>(p);
+    }
+
+    // Value of a SHORT or LONG entry
+    quint32 number(qint64 entry) const {
+        return (u16(entry + 2) == 3) ? u16(entry + 8) : u32(entry + 8);
+    }
+
+    // Value of an ASCII entry, up to four bytes are stored in the entry itself
+    QString text(qint64 entry) const {
+        quint32 const count = u32(entry + 4);
+        qint64 const offset = (count <= 4) ? entry + 8 : qint64(u32(entry + 8));
+        if (u16(entry + 2) != 2 || count == 0 || offset + count > m_data.size()) {
+            return QString();
+        }
+        QByteArray value = m_data.mid(offset, count);
+        value.truncate(value.indexOf('\0') < 0 ? value.size() : value.indexOf('\0'));
+        return QString::fromUtf8(value).trimmed();
+    }
+
+    // Offsets of the 12 byte entries of the IFD at offset
+    QList<qint64> entries(qint64 offset) const {
+        QList<qint64> result;
+        quint16 const count = u16(offset);
+        for (quint16 i = 0; i < count && offset + 2 + (i + 1) * 12 <= m_data.size(); ++i) {
+            result.push_back(offset + 2 + i * 12);
+        }
+        return result;
+    }
+
+private:
+    QByteArray const &m_data;
+    bool m_little = false;
+};
+}
+
+ImageMetadata ImageMetadata::read(QString const &filename, QString &error) {
+    ImageMetadata md;
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = file.errorString();
+        return md;
+    }
+
+    // The image handlers read the size from the header as well
+    {
+        QImageReader reader(&file);
+        md.size = reader.size();
+    }
+    file.seek(0);
+    QByteArray const head = file.read(headsize);
+
+    QByteArray const tiff = findExif(head);
+    if (!tiff.isEmpty()) {
+        md.parseTiff(tiff);
+    }
+    return md;
+}
+
+QByteArray ImageMetadata::findExif(QByteArray const &head) {
+    // TIFF and raw formats built on it are EXIF themselves
+    if (head.startsWith(QByteArray("II*\0", 4)) || head.startsWith(QByteArray("MM\0*", 4))) {
+        return head;
+    }
+
+    // JPEG: APP1 segment starting with "Exif\0\0", before the first scan
+    if (head.startsWith("\xFF\xD8")) {
+        qint64 pos = 2;
+        while (pos + 4 <= head.size() && uchar(head[pos]) == 0xFF) {
+            uchar const marker = uchar(head[pos + 1]);
+            if (marker == 0xDA || marker == 0xD9) {
+                break;
+            }
+            qint64 const length = qFromBigEndian<quint16>(head.constData() + pos + 2);
+            if (marker == 0xE1 && head.mid(pos + 4, 6) == QByteArray("Exif\0\0", 6)) {
+                return head.mid(pos + 10, length - 8);
+            }
+            pos += 2 + length;
+        }
+        return QByteArray();
+    }
+
+    // PNG: eXIf chunk, which has to come before the image data
+    if (head.startsWith("\x89PNG\r\n\x1a\n")) {
+        qint64 pos = 8;
+        while (pos + 8 <= head.size()) {
+            qint64 const length = qFromBigEndian<quint32>(head.constData() + pos);
+            QByteArray const type = head.mid(pos + 4, 4);
+            if (type == "eXIf") {
+                return head.mid(pos + 8, length);
+            }
+            if (type == "IDAT") {
+                break;
+            }
+            pos += 12 + length;
+        }
+        return QByteArray();
+    }
+
+    // WebP: EXIF chunk of the RIFF container, some writers keep the JPEG style prefix
+    if (head.startsWith("RIFF") && head.mid(8, 4) == "WEBP") {
+        qint64 pos = 12;
+        while (pos + 8 <= head.size()) {
+            qint64 const length = qFromLittleEndian<quint32>(head.constData() + pos + 4);
+            if (head.mid(pos, 4) == "EXIF") {
+                QByteArray exif = head.mid(pos + 8, length);
+                if (exif.startsWith(QByteArray("Exif\0\0", 6))) {
+                    exif.remove(0, 6);
+                }
+                return exif;
+            }
+            pos += 8 + length + (length & 1);
+        }
+    }
+    return QByteArray();
+}
+
+void ImageMetadata::parseTiff(QByteArray const &tiff) {
+    TiffReader const r(tiff);
+    if (!r.valid()) {
+        return;
+    }
+
+    QString make, model, datetime;
+    qint64 exififd = 0;
+    for (qint64 e : r.entries(r.u32(4))) {
+        switch (r.u16(e)) {
+        case 0x010F:
+            make = r.text(e);
+            break;
+        case 0x0110:
+            model = r.text(e);
+            break;
+        case 0x0112:
+            orientation = int(r.number(e));
+            break;
+        case 0x0132:
+            datetime = r.text(e);
+            break;
+        case 0x8769:
+            exififd = r.u32(e + 8);
+            break;
+        }
+    }
+
+    QSize exifsize;
+    if (exififd > 0) {
+        for (qint64 e : r.entries(exififd)) {
+            switch (r.u16(e)) {
+            case 0x9003: // DateTimeOriginal, preferred over the modification date of IFD0
+                if (QString const original = r.text(e); !original.isEmpty()) {
+                    datetime = original;
+                }
+                break;
+            case 0xA434:
+                lens = r.text(e);
+                break;
+            case 0xA002:
+                exifsize.setWidth(int(r.number(e)));
+                break;
+            case 0xA003:
+                exifsize.setHeight(int(r.number(e)));
+                break;
+            }
+        }
+    }
+
+    if (orientation < 1 || orientation > 8) {
+        orientation = 1;
+    }
+    // Most models already start with the maker
+    camera = model.startsWith(make, Qt::CaseInsensitive) ? model : (make + ' ' + model).trimmed();
+    captured = QDateTime::fromString(datetime, QStringLiteral(u"yyyy:MM:dd HH:mm:ss"));
+    if (!size.isValid() && exifsize.isValid()) {
+        size = exifsize;
+    }
+}
+
+QTransform ImageMetadata::orientationTransform(int orientation) {
+    switch (orientation) {
+    case 2: // mirrored
+        return QTransform(-1, 0, 0, 1, 0, 0);
+    case 3: // upside down
+        return QTransform(-1, 0, 0, -1, 0, 0);
+    case 4: // mirrored upside down
+        return QTransform(1, 0, 0, -1, 0, 0);
+    case 5: // transposed
+        return QTransform(0, 1, 1, 0, 0, 0);
+    case 6: // rotated 90 degrees clockwise
+        return QTransform(0, 1, -1, 0, 0, 0);
+    case 7: // transversed
+        return QTransform(0, -1, -1, 0, 0, 0);
+    case 8: // rotated 90 degrees counterclockwise
+        return QTransform(0, -1, 1, 0, 0, 0);
+    default:
+        return QTransform();
+    }
+}
+
+QSize ImageMetadata::orientedSize(QSize size, int orientation) {
+    return (orientation >= 5) ? size.transposed() : size;
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <QByteArray>
+#include <QDateTime>
+#include <QSize>
+#include <QString>
+#include <QTransform>
+
+// What the file header tells about an image without decoding any pixels: the EXIF capture
+// date, orientation, camera and lens, and the pixel size. EXIF is found in JPEG APP1, TIFF
+// (and TIFF based raw formats), the PNG eXIf chunk and the WebP EXIF chunk.
+struct ImageMetadata {
+    QDateTime captured;
+    int orientation = 1; // EXIF orientation, 1 is upright
+    QString camera;
+    QString lens;
+    QSize size;
+
+    static ImageMetadata read(QString const &filename, QString &error);
+
+    // Maps the stored pixels to the upright image, centered on the origin
+    static QTransform orientationTransform(int orientation);
+    // Size of the upright image
+    static QSize orientedSize(QSize size, int orientation);
+
+private:
+    static QByteArray findExif(QByteArray const &head);
+    void parseTiff(QByteArray const &tiff);
+};
@@ -0,0 +1,116 @@
+#include "ImagePipeline.h"
+#include <QDeadlineTimer>
+#include <QDebug>
+#include <QSettings>
+#include <QThread>
+
+namespace {
+// Set on every stage worker, only those feel backpressure
+thread_local bool t_stage_worker = false;
+
+int setting(QString const &key, int fallback) {
+    QSettings const settings("ImgView", "ImgView");
+    return std::max(1, settings.value("Pipeline/" + key, fallback).toInt());
+}
+
+// Readers per storage kind: a spinning disk wants one sequential reader, a network share
+// needs many requests in flight to hide latency
+int defaultReaders() {
+    QSettings const settings("ImgView", "ImgView");
+    QString const storage = settings.value("Pipeline/Storage", "ssd").toString();
+    if (storage == "hdd") {
+        return 1;
+    } else if (storage == "network") {
+        return 16;
+    }
+    return 4;
+}
+}
+
+PipelineStage::PipelineStage(QString name, int threads, int capacity)
+    : m_name(name)
+    , m_slots(capacity)
+    , m_capacity(capacity) {
+    m_pool.setMaxThreadCount(threads);
+    m_pool.setObjectName(name);
+}
+
+void PipelineStage::submit(std::function<void()> fn, int priority) {
+    if (t_stage_worker) {
+        m_slots.acquire();
+    } else {
+        // Checked under the lock release() takes, so a slot freed meanwhile is not missed
+        QMutexLocker lock(&m_mutex);
+        if (!m_slots.tryAcquire()) {
+            m_parked.emplace(priority, std::move(fn));
+            return;
+        }
+    }
+    run(std::move(fn), priority);
+}
+
+void PipelineStage::run(std::function<void()> fn, int priority) {
+    m_pool.start([this, fn = std::move(fn)]() {
+        t_stage_worker = true;
+        fn();
+        release();
+    }, priority);
+}
+
+void PipelineStage::release() {
+    // A parked job takes the slot over directly; it is started before this worker
+    // finishes, so waitForDone() does not return while jobs are parked
+    std::function<void()> next;
+    int priority = 0;
+    {
+        QMutexLocker lock(&m_mutex);
+        if (m_parked.empty()) {
+            m_slots.release();
+            return;
+        }
+        auto it = m_parked.begin();
+        priority = it->first;
+        next = std::move(it->second);
+        m_parked.erase(it);
+    }
+    run(std::move(next), priority);
+}
+
+void PipelineStage::clear() {
+    QMutexLocker lock(&m_mutex);
+    m_parked.clear();
+}
+
+void PipelineStage::start(QRunnable *runnable, int priority) {
+    submit([runnable]() {
+        runnable->run();
+        if (runnable->autoDelete()) {
+            delete runnable;
+        }
+    }, priority);
+}
+
+void PipelineStage::setThreads(int threads) {
+    m_pool.setMaxThreadCount(std::max(1, threads));
+}
+
+ImagePipeline &ImagePipeline::instance() {
+    static ImagePipeline pipeline;
+    return pipeline;
+}
+
+ImagePipeline::ImagePipeline()
+    : enumerate("enumerate", setting("EnumerateThreads", 2), 64)
+    , read("read", setting("ReadThreads", defaultReaders()), setting("ReadQueue", 64))
+    , decode("decode", setting("DecodeThreads", QThread::idealThreadCount() / 3 * 2), setting("DecodeQueue", 2 * QThread::idealThreadCount()))
+    , encode("encode", setting("EncodeThreads", QThread::idealThreadCount() / 4), setting("EncodeQueue", 2 * QThread::idealThreadCount()))
+    , bands("bands", setting("BandThreads", QThread::idealThreadCount()), 1) {
+    qDebug() << "pipeline threads read" << read.threads() << "decode" << decode.threads() << "encode" << encode.threads();
+}
+
+bool ImagePipeline::waitForDone(int msecs) {
+    // Upstream first, each stage only feeds the ones after it
+    QDeadlineTimer const deadline(msecs);
+    return enumerate.waitForDone(int(deadline.remainingTime())) && read.waitForDone(int(deadline.remainingTime())) &&
+           decode.waitForDone(int(deadline.remainingTime())) && encode.waitForDone(int(deadline.remainingTime()));
+}
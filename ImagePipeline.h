@@ -0,0 +1,63 @@
+#pragma once
+#include <QMutex>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QString>
+#include <QThreadPool>
+#include <functional>
+#include <map>
+
+// One stage of the loader pipeline: its own workers and a bounded queue. Workers of an
+// upstream stage block in submit() while this stage is full, so buffers held between
+// stages stay bounded. Event loop threads (GUI, database) never block; past the bound
+// their jobs are parked and handed the next free slot, highest priority first.
+class PipelineStage {
+public:
+    PipelineStage(QString name, int threads, int capacity);
+
+    void submit(std::function<void()> fn, int priority = 0);
+    void start(QRunnable *runnable, int priority = 0);
+    void setThreads(int threads);
+    int threads() const { return m_pool.maxThreadCount(); }
+    QThreadPool *pool() { return &m_pool; }
+    int capacity() const { return m_capacity; }
+    QString const &name() const { return m_name; }
+    bool waitForDone(int msecs = -1) { return m_pool.waitForDone(msecs); }
+    // Drops the parked jobs, the ones already queued in the pool still run
+    void clear();
+
+private:
+    void run(std::function<void()> fn, int priority);
+    void release();
+
+    QString m_name;
+    QThreadPool m_pool;
+    QSemaphore m_slots;
+    int m_capacity;
+    QMutex m_mutex;
+    std::multimap<int, std::function<void()>, std::greater<int>> m_parked;
+};
+
+// Stages of the loader: enumerate directories, read file bytes, decode pixels, scale and
+// encode thumbnails. Persisting is done by the ImageHashStore on its own thread.
+// The bands pool is not a stage of its own, ParallelImage uses it to split a single large
+// image across all cores.
+// Thread counts come from the "Pipeline" settings group, see ImagePipeline.cpp.
+class ImagePipeline {
+public:
+    static ImagePipeline &instance();
+
+    enum Priority { prefetch = -1, thumbnail = 0, image = 1 };
+
+    PipelineStage enumerate;
+    PipelineStage read;
+    PipelineStage decode;
+    PipelineStage encode;
+    PipelineStage bands;
+
+    // Waits at most msecs in total, -1 waits until everything is done
+    bool waitForDone(int msecs = -1);
+
+private:
+    ImagePipeline();
+};
@@ -2,17 +2,27 @@
 #include <QGuiApplication>
 #include <QImageReader>
 #include <QInputDialog>
+#include <QLineEdit>
 #include <QMimeData>
 #include <QPainter>
 #include <QPainterPath>
+#include <QScreen>
 #include <QSettings>
+#include <QShortcut>
 #include <QStyle>
-#include <QThreadPool>
 #include <QtConcurrent>
+#include <cmath>
+#include <limits>
+#include <numeric>
 #include <qvariant.h>
 
+#include "ArchiveIndex.h"
+#include "Bench.h"
 #include "DirIteratorTask.h"
+#include "ImagePipeline.h"
 #include "ImgView.h"
+#include "InputRecorder.h"
+#include "Session.h"
 
 ImgView::ImgView(QWidget *p)
     : QWidget(p) {
@@ -41,7 +51,7 @@ ImgView::ImgView(QWidget *p)
     connect(btnOpen, &QPushButton::clicked, [this]() { openFolder(QString()); });
 
     QPushButton *btnOpenDatabase = new QPushButton(QStringLiteral(u"🗃️"), this);
-    btnOpenDatabase->setToolTip(QStringLiteral(u"Open Folder"));
+    btnOpenDatabase->setToolTip(QStringLiteral(u"Browse Thumbnail Database"));
     btnOpenDatabase->setFixedSize(24, 24);
     btnOpenDatabase->raise();
     m_buttons.push_back(btnOpenDatabase);
@@ -107,16 +117,85 @@ ImgView::ImgView(QWidget *p)
         settings.setValue("Wheel zoom", m_wheel_zoom);
     });
 
-    QThreadPool::globalInstance()->setMaxThreadCount(QThread::idealThreadCount() / 3 * 2);
+    m_hierarchical = settings.value("Hierarchical").toBool();
+    QPushButton *btnHierarchical = new QPushButton(
+        m_hierarchical ? QStringLiteral(u"🗂️") : QStringLiteral(u"📚"), this);
+    btnHierarchical->setToolTip(QStringLiteral(u"List subfolders when they are shown"));
+    btnHierarchical->setFixedSize(24, 24);
+    btnHierarchical->raise();
+    m_buttons.push_back(btnHierarchical);
+    connect(btnHierarchical, &QPushButton::clicked, [this, btnHierarchical]() {
+        setHierarchical(!m_hierarchical);
+        btnHierarchical->setText(m_hierarchical ? QStringLiteral(u"🗂️") : QStringLiteral(u"📚"));
+    });
+
+    QPushButton *btnSearch = new QPushButton(QStringLiteral(u"🔎"), this);
+    btnSearch->setToolTip(QStringLiteral(u"Search file names (Ctrl+F)"));
+    btnSearch->setFixedSize(24, 24);
+    btnSearch->raise();
+    m_buttons.push_back(btnSearch);
+    connect(btnSearch, &QPushButton::clicked, [this]() {
+        if (m_searchbox->isVisible()) {
+            hideSearch();
+        } else {
+            showSearch();
+        }
+    });
+
+    // Search as you type, the grid shows only the matching files
+    m_searchbox = new QLineEdit(this);
+    m_searchbox->setPlaceholderText(QStringLiteral(u"Search file names"));
+    m_searchbox->setClearButtonEnabled(true);
+    m_searchbox->hide();
+    connect(m_searchbox, &QLineEdit::textChanged, this, &ImgView::setFilter);
+    connect(m_searchbox, &QLineEdit::returnPressed, [this]() { setFocus(); });
+    QShortcut *escape = new QShortcut(QKeySequence(Qt::Key_Escape), m_searchbox);
+    escape->setContext(Qt::WidgetShortcut);
+    connect(escape, &QShortcut::activated, this, &ImgView::hideSearch);
 
     connect(&m_imageloaderqueue, &ImageLoaderQueue::requestReady, this, &ImgView::loadedImage);
+    connect(&m_imageloaderqueue, &ImageLoaderQueue::metadataReady, this, &ImgView::loadedMetadata);
+
+    // Under memory pressure fewer neighbours stay decoded and fewer thumbnails resident
+    connect(&m_governor, &MemoryGovernor::levelChanged, this, [this]() {
+        updateBigImages();
+        trimThumbs();
+        update();
+    });
+
+    m_adopt_timer.setInterval(0);
+    connect(&m_adopt_timer, &QTimer::timeout, this, &ImgView::adoptLoadedImages);
+    m_settle_timer.setInterval(250);
+    m_settle_timer.setSingleShot(true);
+    connect(&m_settle_timer, &QTimer::timeout, this, &ImgView::updateThumbs);
+
+    // Input recording for ImgViewReplay
+    if (qEnvironmentVariableIsSet("IMGVIEW_RECORD")) {
+        new InputRecorder(this, qEnvironmentVariable("IMGVIEW_RECORD"));
+    }
 };
 
 ImgView::~ImgView() {};
 
+bool ImgView::event(QEvent *event) {
+    // Input to the frame that shows its effect, timed from the first input not yet painted
+    switch (event->type()) {
+    case QEvent::KeyPress:
+    case QEvent::Wheel:
+    case QEvent::MouseButtonPress:
+    case QEvent::MouseMove:
+        if (Bench::enabled() && !m_inputtoframe.isValid()) {
+            m_inputtoframe.start();
+        }
+        break;
+    default:
+        break;
+    }
+    return QWidget::event(event);
+}
+
 void ImgView::paintEvent(QPaintEvent *) {
-    QElapsedTimer timer;
-    timer.start();
+    Bench::Scope const bench(QStringLiteral(u"gui.paint"));
     QPainter p(this);
 
     if (m_antialiase) {
@@ -125,11 +204,149 @@ void ImgView::paintEvent(QPaintEvent *) {
 
     p.setTransform(m_transform);
 
-    for (auto *ii : m_allImages) {
-        ii->draw(p, m_mouselogicalpos);
+    // Only the cells inside the viewport are touched, independent of the catalog size
+    QRect const cells = visibleCells();
+    int const hovered = indexAt(m_mouselogicalpos);
+    int shown = 0;
+    bool complete = !m_listing && m_deferred_listing.isEmpty();
+    for (int y = cells.top(); y <= cells.bottom(); ++y) {
+        for (int x = cells.left(); x <= cells.right(); ++x) {
+            int const pos = y * m_xdim + x;
+            if (pos >= cellCount()) {
+                break;
+            }
+            int const idx = catalogIndex(pos);
+            drawItem(p, idx, idx == hovered);
+            complete = complete && m_catalog.thumb(idx);
+            shown++;
+        }
+    }
+
+    // Time from process start until the first preview and full image were painted
+    for (auto const &mark : std::as_const(m_startup_marks)) {
+        Bench::mark(mark);
+    }
+    m_startup_marks.clear();
+    // Warm opens are served from thumbs.db, cold ones generate every thumbnail
+    if (m_opentothumbs.isValid() && complete && shown > 0) {
+        Bench::record(QStringLiteral(u"view.openToThumbs"), m_opentothumbs.nsecsElapsed());
+        Bench::count(QStringLiteral(u"view.openThumbs"), shown);
+        m_opentothumbs.invalidate();
+    }
+    if (m_inputtoframe.isValid()) {
+        Bench::record(QStringLiteral(u"gui.inputToFrame"), m_inputtoframe.nsecsElapsed());
+        m_inputtoframe.invalidate();
+    }
+    if (m_nexttoimage.isValid() && m_mainImage >= 0 && m_catalog.image(m_mainImage)) {
+        Bench::record(QStringLiteral(u"view.nextToImage"), m_nexttoimage.nsecsElapsed());
+        m_nexttoimage.invalidate();
+    }
+}
+
+void ImgView::drawItem(QPainter &p, int idx, bool undermouse) {
+    QRectF rect = cellRect(idx);
+    QPen pen = p.pen();
+    pen.setCosmetic(true);
+    p.setPen(pen);
+
+    // Draw rect or thumb or real image
+    QPixmap const *img = m_catalog.image(idx);
+    QPixmap const *thumb = m_catalog.thumb(idx);
+    if (undermouse && img) {
+        drawOriented(p, rect, *img, m_catalog.orientation(idx));
+    } else if (thumb) {
+        drawOriented(p, rect, *thumb, m_catalog.orientation(idx));
+    } else {
+        p.setPen(QPen(Qt::black, 0));
+        p.drawRect(rect);
     }
 
-    // qDebug() << "Paintevent time us: " << timer.nsecsElapsed() / 1000;
+    // Folder not listed yet: its cover with the folder name
+    if (auto const folder = m_folders.constFind(idx); folder != m_folders.cend()) {
+        QTransform const t = p.worldTransform();
+        QRectF const shown = t.mapRect(rect);
+        int const textheight = p.fontMetrics().height() + 4;
+        if (shown.height() >= 2 * textheight) {
+            p.save();
+            p.resetTransform();
+            QRectF const label(shown.left(), shown.bottom() - textheight, shown.width(), textheight);
+            p.fillRect(label, QColor(0, 0, 0, 160));
+            p.setPen(Qt::white);
+            QString const name = QStringLiteral(u"📁 ") + QFileInfo(folder.value()).fileName();
+            p.drawText(label.adjusted(4, 0, -4, 0), Qt::AlignVCenter | Qt::AlignLeft,
+                       p.fontMetrics().elidedText(name, Qt::ElideRight, int(label.width()) - 8));
+            p.restore();
+        }
+    }
+
+    // draw red rect around hovered image
+    if (undermouse) {
+        QTransform const t = p.worldTransform();
+        QRectF logicalRect = t.mapRect(cellRect(idx));
+        p.setPen(QPen(Qt::red, 0));
+        logicalRect.adjust(1, 1, -1, -1);
+        p.drawRect(t.inverted().mapRect(logicalRect));
+    }
+}
+
+void ImgView::drawOriented(QPainter &p, QRectF cell, QPixmap const &pixmap, int orientation) {
+    // Pixels are kept as stored in the file, the EXIF orientation is part of the transform
+    QSizeF const shown = ImageMetadata::orientedSize(pixmap.size(), orientation).toSizeF().scaled(cell.size(), Qt::KeepAspectRatio);
+    QSizeF const stored = (orientation >= 5) ? shown.transposed() : shown;
+    QRectF const target(cell.topLeft(), shown);
+    p.save();
+    p.translate(target.center());
+    p.setTransform(ImageMetadata::orientationTransform(orientation), true);
+    p.drawPixmap(QRectF(QPointF(-stored.width() / 2., -stored.height() / 2.), stored), pixmap, QRectF(QPointF(0, 0), pixmap.size()));
+    p.restore();
+}
+
+QRectF ImgView::cellRect(int idx) const {
+    int const pos = positionOf(idx);
+    return QRectF(QPointF(pos % m_xdim, pos / m_xdim), QSizeF(1., 1.));
+}
+
+int ImgView::cellCount() const {
+    return m_filtering ? int(m_filtered.size()) : m_catalog.size();
+}
+
+int ImgView::catalogIndex(int pos) const {
+    if (m_filtering) {
+        return m_filtered[pos];
+    }
+    return m_hierarchical ? m_order[pos] : pos;
+}
+
+int ImgView::positionOf(int idx) const {
+    if (idx < 0) {
+        return -1;
+    }
+    if (m_filtering) {
+        return m_position[idx];
+    }
+    return m_hierarchical ? m_rank[idx] : idx;
+}
+
+QRect ImgView::visibleCells() const { return cellsIn(m_transform.inverted().mapRect(QRectF(this->rect()))); }
+
+QRect ImgView::cellsIn(QRectF const &logicalRect) const {
+    if (m_xdim <= 0 || logicalRect.isEmpty()) {
+        return QRect();
+    }
+    int const rows = (cellCount() + m_xdim - 1) / m_xdim;
+    int const left = std::max(0, int(std::floor(logicalRect.left())));
+    int const top = std::max(0, int(std::floor(logicalRect.top())));
+    int const right = std::min(m_xdim - 1, int(std::floor(logicalRect.right())));
+    int const bottom = std::min(rows - 1, int(std::floor(logicalRect.bottom())));
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+int ImgView::indexAt(QPointF logicalpos) const {
+    if (m_xdim <= 0 || logicalpos.x() < 0 || logicalpos.y() < 0 || logicalpos.x() >= m_xdim) {
+        return -1;
+    }
+    int const pos = int(logicalpos.y()) * m_xdim + int(logicalpos.x());
+    return pos < cellCount() ? catalogIndex(pos) : -1;
 }
 
 void ImgView::mouseDoubleClickEvent(QMouseEvent *) { autofit(); }
@@ -205,6 +422,7 @@ void ImgView::resizeEvent(QResizeEvent *event) {
         idx++;
         height = padding + idx * (b->height() + padding);
     }
+    m_searchbox->setGeometry(padding, padding, std::min(320, width() / 2), 24);
     setMinimumHeight(height);
     setMinimumWidth(2 * height);
 
@@ -220,6 +438,20 @@ void ImgView::keyPressEvent(QKeyEvent *event) {
     } else if (event->key() == Qt::Key_PageUp || event->key() == Qt::Key_Left) {
         nextImage(FileDir::previous);
         event->accept();
+    } else if (event->matches(QKeySequence::Find)) {
+        showSearch();
+        event->accept();
+    } else if (m_animation && event->key() == Qt::Key_P) {
+        m_animation->setPaused(!m_animation->isPaused());
+        event->accept();
+    } else if (m_animation && event->key() == Qt::Key_Home) {
+        m_animation->seek(0);
+        event->accept();
+    } else if (m_animation && (event->key() == Qt::Key_BracketLeft || event->key() == Qt::Key_BracketRight)) {
+        // Jump a tenth of the animation
+        int const step = std::max(1, m_animation->frameCount() / 10);
+        m_animation->seek(m_animation->currentFrame() + ((event->key() == Qt::Key_BracketLeft) ? -step : step));
+        event->accept();
     } else {
         QWidget::keyPressEvent(event);
     }
@@ -235,6 +467,9 @@ void ImgView::loadImage(QStringList filenames) {
         for (auto const &s : DirIteratorTask::supportedExtensions()) {
             supported += "*." + s + ' ';
         }
+        for (auto const &s : ArchiveIndex::extensions()) {
+            supported += "*." + s + ' ';
+        }
         supported += ')';
         filenames.push_back(QFileDialog::getOpenFileName(
             this, tr("Load Image File"), lastDir, supported));
@@ -242,7 +477,8 @@ void ImgView::loadImage(QStringList filenames) {
             return;
         }
         if (!DirIteratorTask::supportedExtensions().contains(
-                QFileInfo(filenames.front()).suffix().toLower())) {
+                QFileInfo(filenames.front()).suffix().toLower()) &&
+            !ArchiveIndex::isArchive(QFileInfo(filenames.front()))) {
             emit message(
                 QStringLiteral(u"Not supported '%1'").arg(filenames.front()));
             return;
@@ -251,14 +487,215 @@ void ImgView::loadImage(QStringList filenames) {
                           QFileInfo(filenames.back()).absolutePath());
     }
 
-    getFiles(filenames, QDirIterator::Subdirectories);
+    // A single file is shown before its directory is listed
+    if (filenames.size() == 1 && QFileInfo(filenames.front()).isFile() && !ArchiveIndex::isArchive(QFileInfo(filenames.front()))) {
+        showFirst(filenames.front());
+    } else {
+        getFiles(filenames, QDirIterator::Subdirectories);
+    }
 }
 
-void ImgView::getFiles(QStringList filenames, QDirIterator::IteratorFlag itf) {
+void ImgView::showFirst(QString filename) {
     clearImages();
-    DirIteratorTask *dit = new DirIteratorTask(filenames, itf);
+    m_sources = QStringList{ filename };
+    m_mainImage = addToCatalog(DirIteratorTask::workItem(QFileInfo(filename)));
+    layoutGrid();
+    setTitle();
+
+    // Straight to the loader: a quick preview sized for the screen, then the full image.
+    // Listing the directory and loading neighbours waits until the full image is in.
+    WorkItem wi = m_catalog.workItem(m_mainImage);
+    wi.loadimage = true;
+    wi.loadthumb = true;
+    wi.m_previewsize = screen()->size() * screen()->devicePixelRatio();
+    m_bigimages.insert(m_mainImage);
+    m_deferred_listing = QStringList{ filename };
+    m_imageloaderqueue.requestImage(wi);
+    m_imageloaderqueue.requestMetadata(QList<WorkItem>{ wi });
+}
+
+void ImgView::getFiles(QStringList filenames, QDirIterator::IteratorFlag itf, bool listed) {
+    if (!listed) {
+        clearImages();
+        m_sources = filenames;
+    }
+    DirIteratorTask *dit = new DirIteratorTask(filenames, itf, listed);
+    dit->setCancelToken(m_imageloaderqueue.token());
+    if (m_hierarchical && (itf & QDirIterator::Subdirectories)) {
+        // Only the top is listed, subfolders wait until they are shown
+        dit->setFolderCovers();
+    }
     connect(dit, &DirIteratorTask::loadedFilenames, this, &ImgView::loadedFilenames);
-    QThreadPool::globalInstance()->start(dit);
+    m_listing = true;
+    connect(dit, &DirIteratorTask::finished, this, [this, token = m_imageloaderqueue.token()]() {
+        if (!token.isCancelled()) {
+            m_listing = false;
+            saveListing();
+            continueRestore();
+            update();
+        }
+        qDebug() << "catalog holds" << m_catalog.size() << "images," << m_catalog.bytesPerEntry() << "bytes per entry without pixmaps";
+    });
+    ImagePipeline::instance().enumerate.start(dit);
+}
+
+bool ImgView::restoreSession() {
+    QSettings const settings("ImgView", "ImgView");
+    Session session;
+    if (!settings.value("RestoreSession", true).toBool() || !session.load() || session.sources.isEmpty()) {
+        return false;
+    }
+    if (session.entries.empty() || m_hierarchical) {
+        // Hierarchical listings are not snapshotted, listing their top again is as quick.
+        // The view follows once the folders down to the main file are listed.
+        getFiles(session.sources, QDirIterator::Subdirectories);
+        m_pendingview = PendingView{ session.mainfile, session.zoom, session.offset, session.filter };
+        return true;
+    }
+
+    // The snapshot goes straight into the catalog, no file is touched until the main image
+    // and its neighbours are loaded
+    clearImages();
+    m_sources = session.sources;
+    QList<WorkItem> listed;
+    listed.reserve(qsizetype(session.entries.size()));
+    for (auto const &entry : session.entries) {
+        WorkItem wi = session.workItem(entry);
+        wi.m_idx = addToCatalog(wi);
+        listed.push_back(std::move(wi));
+    }
+    m_imageloaderqueue.requestMetadata(listed);
+    layoutGrid();
+    restoreView(session.mainfile, session.zoom, session.offset, session.filter);
+    m_startup_marks.push_back(QStringLiteral(u"startup.session"));
+
+    // Meanwhile the sources are listed again, the snapshot is replaced if anything changed
+    DirIteratorTask *dit = new DirIteratorTask(m_sources, QDirIterator::Subdirectories);
+    dit->setCancelToken(m_imageloaderqueue.token());
+    connect(dit, &DirIteratorTask::loadedFilenames, this, [this](QList<WorkItem> is) {
+        if (!is.isEmpty() && !is.front().m_cancel.isCancelled()) {
+            m_revalidation += is;
+        }
+    });
+    connect(dit, &DirIteratorTask::finished, this, [this, token = m_imageloaderqueue.token()]() {
+        if (!token.isCancelled()) {
+            revalidated();
+        }
+    });
+    ImagePipeline::instance().enumerate.start(dit);
+    return true;
+}
+
+void ImgView::revalidated() {
+    QList<WorkItem> listing = std::exchange(m_revalidation, QList<WorkItem>());
+    bool same = listing.size() == m_catalog.size();
+    for (int idx = 0; same && idx < listing.size(); ++idx) {
+        same = m_catalog.matches(idx, listing[idx].m_hash);
+    }
+    qDebug() << "session revalidated," << (same ? "unchanged" : "listing changed");
+    if (same) {
+        return;
+    }
+
+    // Files were added, removed or edited: take the new listing and keep the view
+    QString const mainfile = (m_mainImage >= 0) ? m_catalog.filePath(m_mainImage) : QString();
+    QStringList const sources = m_sources;
+    double const zoom = m_zoom;
+    QPointF const offset = m_offset;
+    QString const filter = m_filter;
+    clearImages();
+    m_sources = sources;
+    for (auto &wi : listing) {
+        wi.m_cancel = m_imageloaderqueue.token();
+        wi.m_idx = addToCatalog(wi);
+    }
+    m_imageloaderqueue.requestMetadata(listing);
+    layoutGrid();
+    restoreView(mainfile, zoom, offset, filter);
+    saveListing();
+}
+
+void ImgView::restoreView(QString const &mainfile, double zoom, QPointF offset, QString const &filter) {
+    m_mainImage = indexOf(mainfile);
+    if (!filter.isEmpty()) {
+        m_searchbox->setText(filter);
+        m_searchbox->show();
+    }
+    // Main image and neighbours are requested before the visible thumbnails
+    m_zoom = zoom;
+    m_offset = offset;
+    setTransform();
+    nextImage(FileDir::none);
+}
+
+void ImgView::continueRestore(QList<WorkItem> const &listed) {
+    if (!m_pendingview) {
+        return;
+    }
+    QString const &mainfile = m_pendingview->mainfile;
+    if (!mainfile.isEmpty()) {
+        // One level at a time, each listed folder brings the next one down as a cover
+        for (auto it = m_folders.cbegin(); it != m_folders.cend(); ++it) {
+            if (mainfile.startsWith(it.value() + '/')) {
+                expandFolder(it.key());
+                return;
+            }
+        }
+        // Only the new entries are checked, a large listing arrives in many batches. A main
+        // file gone since the session was saved waits until nothing is listed any more.
+        QString const name = QFileInfo(mainfile).fileName();
+        bool const found = std::any_of(listed.cbegin(), listed.cend(), [&](WorkItem const &wi) {
+            return wi.fi.fileName() == name && wi.fi.absoluteFilePath() == mainfile;
+        });
+        if (!found && (m_listing || m_expanding > 0)) {
+            return;
+        }
+    }
+    PendingView const view = *std::exchange(m_pendingview, std::nullopt);
+    restoreView(view.mainfile, view.zoom, view.offset, view.filter);
+}
+
+int ImgView::indexOf(QString const &path) const {
+    QFileInfo const fi(path);
+    QString const dir = fi.absolutePath();
+    QString const name = fi.fileName();
+    for (int d = 0; d < m_catalog.dirCount(); ++d) {
+        if (m_catalog.dir(d) != dir) {
+            continue;
+        }
+        for (int idx = 0; idx < m_catalog.size(); ++idx) {
+            if (m_catalog.dirIndex(idx) == d && m_catalog.fileNameView(idx) == name) {
+                return idx;
+            }
+        }
+    }
+    return -1;
+}
+
+void ImgView::saveSession() {
+    // Database browsing is not restored, it has no sources to revalidate against
+    if (m_sources.isEmpty() || m_catalog.isEmpty()) {
+        Session::remove();
+        return;
+    }
+    // Only the view, the listing was written when it completed
+    Session session;
+    session.sources = m_sources;
+    session.mainfile = (m_mainImage >= 0) ? m_catalog.filePath(m_mainImage) : QString();
+    session.zoom = m_zoom;
+    session.offset = m_offset;
+    session.filter = m_filter;
+    session.save();
+}
+
+void ImgView::saveListing() {
+    // Which folders were listed is not part of the snapshot, it would restore as a flat listing
+    if (m_hierarchical || m_sources.isEmpty() || m_catalog.isEmpty()) {
+        return;
+    }
+    ImagePipeline::instance().encode.submit([sources = m_sources, listing = m_catalog.listing()]() {
+        Session::saveListing(sources, listing);
+    }, ImagePipeline::prefetch);
 }
 
 void ImgView::openFolder(QString dir) {
@@ -282,44 +719,316 @@ void ImgView::loaded(WorkItem) {
 }
 
 void ImgView::loadedImage(WorkItem wi, QImage img, QImage thumb, QSize si) {
-    for (auto *ii : m_allImages) {
-        if (ii->hash() == wi.m_hash) {
-            if (!img.isNull()) {
-                ii->setImage(wi, std::move(img));
+    if (wi.m_cancel.isCancelled()) {
+        return;
+    }
+    // The image the user is waiting for jumps the queue
+    if (wi.m_idx >= 0 && wi.m_idx == m_mainImage) {
+        m_loaded.prepend(LoadedImage{ wi, std::move(img), std::move(thumb), si });
+    } else {
+        m_loaded.enqueue(LoadedImage{ wi, std::move(img), std::move(thumb), si });
+    }
+    if (!m_adopt_timer.isActive()) {
+        m_adopt_timer.start();
+    }
+}
+
+void ImgView::adoptLoadedImages() {
+    // Hand results to the items in slices of a few milliseconds, so a burst of
+    // thumbnails never holds up input handling and painting
+    Bench::Scope const bench(QStringLiteral(u"gui.adopt"));
+    qint64 const constexpr budget_ns = 4 * 1000 * 1000;
+    QElapsedTimer ti;
+    ti.start();
+    int const constexpr margin = 2;
+    QRect const nearby = visibleCells().adjusted(-margin, -margin, margin, margin);
+    while (!m_loaded.isEmpty() && ti.nsecsElapsed() < budget_ns) {
+        LoadedImage li = m_loaded.dequeue();
+        int const idx = li.wi.m_idx;
+        if (!m_catalog.matches(idx, li.wi.m_hash)) {
+            // Listing was replaced while it was loading
+            continue;
+        }
+        if (li.si.isValid()) {
+            m_catalog.setImageSize(idx, li.si);
+        }
+        if (idx == m_mainImage) {
+            startupFrame(li.img.isNull() && !li.thumb.isNull());
+            if (li.wi.m_animated && !li.img.isNull()) {
+                startAnimation(idx);
             }
-            if (!thumb.isNull()) {
-                ii->setThumb(wi, std::move(thumb), si);
+        }
+        // The loader delivers display-ready pixels, adopt the buffers without converting
+        if (!li.img.isNull() && m_bigimages.contains(idx)) {
+            Bench::Scope const stall(QStringLiteral(u"gui.setImage"));
+            m_catalog.setImage(idx, QPixmap::fromImage(std::move(li.img), Qt::NoFormatConversion));
+        }
+        if (!li.thumb.isNull()) {
+            Bench::Scope const stall(QStringLiteral(u"gui.setThumb"));
+            thumbRequestDone(idx);
+            int const pos = positionOf(idx);
+            QPoint const cell(pos % std::max(1, m_xdim), pos / std::max(1, m_xdim));
+            if ((pos < 0 || !(nearby.contains(cell) || m_predicted.contains(cell))) && !m_bigimages.contains(idx)) {
+                // Scrolled away or filtered out while it was loading, it would only be evicted again
+                continue;
             }
-            break;
+            m_catalog.setThumb(idx, QPixmap::fromImage(std::move(li.thumb), Qt::NoFormatConversion));
         }
     }
+    if (m_loaded.isEmpty()) {
+        m_adopt_timer.stop();
+    }
+    trimThumbs();
+    update();
+}
+
+void ImgView::loadedMetadata(QList<WorkItem> wis, QList<ImageMetadata> mds) {
+    for (qsizetype i = 0; i < wis.size() && i < mds.size(); ++i) {
+        int const idx = wis[i].m_idx;
+        if (!m_catalog.matches(idx, wis[i].m_hash)) {
+            continue;
+        }
+        m_catalog.setMetadata(idx, mds[i].orientation, mds[i].captured.isValid() ? mds[i].captured.toSecsSinceEpoch() : 0);
+        if (!m_catalog.imageSize(idx).isValid()) {
+            m_catalog.setImageSize(idx, mds[i].size);
+        }
+    }
+    update();
+}
+
+void ImgView::startupFrame(bool preview) {
+    if (m_coldstart) {
+        m_startup_marks.push_back(preview ? QStringLiteral(u"startup.preview") : QStringLiteral(u"startup.image"));
+        m_coldstart = preview;
+    }
+    // The full image (or its error) is in, now list the siblings
+    if (!preview && !m_deferred_listing.isEmpty()) {
+        getFiles(std::exchange(m_deferred_listing, QStringList()), QDirIterator::Subdirectories, true);
+    }
+}
+
+void ImgView::startAnimation(int idx) {
+    if (m_animation && m_animation_idx == idx) {
+        return;
+    }
+    stopAnimation();
+    m_animation = new AnimationPlayer(m_catalog.filePath(idx), this);
+    m_animation_idx = idx;
+    connect(m_animation, &AnimationPlayer::frame, this, [this](QImage image) {
+        if (m_bigimages.contains(m_animation_idx)) {
+            m_catalog.setImage(m_animation_idx, QPixmap::fromImage(std::move(image), Qt::NoFormatConversion));
+            update();
+        }
+    });
+}
+
+void ImgView::stopAnimation() {
+    delete m_animation;
+    m_animation = nullptr;
+    m_animation_idx = -1;
 }
 
 void ImgView::loadedFilenames(QList<WorkItem> is) {
-    if (is.isEmpty()) {
+    // Still queued from a listing that was replaced
+    if (is.isEmpty() || is.front().m_cancel.isCancelled()) {
         return;
     }
 
-    for (auto i : is) {
-        ImageItem *ii = new ImageItem(i.fi);
-        m_allImages.push_back(ii);
-        connect(ii, &ImageItem::requestImageData, &m_imageloaderqueue, &ImageLoaderQueue::insert);
+    for (auto &wi : is) {
+        wi.m_idx = addToCatalog(wi);
+        if (!wi.m_folder.isEmpty()) {
+            m_folders.insert(wi.m_idx, wi.m_folder);
+        }
     }
+    m_imageloaderqueue.requestMetadata(is);
+
+    layoutGrid();
+    updateThumbs();
+    nextImage(ImgView::FileDir::none);
+    continueRestore(is);
+}
 
-    // Calculate Position in grid
-    int const dim = std::ceil(std::sqrt(m_allImages.size()));
-    ImageItem::setXdim(dim);
-    int x = 0, y = 0, idx = 0;
-    for (auto *ii : m_allImages) {
-        ii->setIdx(idx++, QPoint(x, y));
-        x++;
-        if (x >= dim) {
-            x = 0;
-            y++;
+void ImgView::expandFolder(int idx) {
+    auto const folder = m_folders.constFind(idx);
+    if (folder == m_folders.cend()) {
+        return;
+    }
+    DirIteratorTask *dit = new DirIteratorTask(QStringList{ folder.value() }, QDirIterator::NoIteratorFlags);
+    dit->setCancelToken(m_imageloaderqueue.token());
+    dit->setFolderCovers(m_catalog.workItem(idx));
+    m_folders.erase(folder);
+    // Each batch goes in behind the previous one, the first behind the cover
+    connect(dit, &DirIteratorTask::loadedFilenames, this, [this, after = idx](QList<WorkItem> is) mutable {
+        listedFolder(after, std::move(is));
+    });
+    m_expanding++;
+    connect(dit, &DirIteratorTask::finished, this, [this, token = m_imageloaderqueue.token()]() {
+        if (!token.isCancelled()) {
+            m_expanding--;
+            continueRestore();
         }
+    });
+    ImagePipeline::instance().enumerate.start(dit);
+}
+
+void ImgView::listedFolder(int &after, QList<WorkItem> is) {
+    if (is.isEmpty() || is.front().m_cancel.isCancelled()) {
+        return;
+    }
+
+    int const first = m_catalog.size();
+    QList<WorkItem> added;
+    for (auto &wi : is) {
+        // The old cover comes back as cover of the subfolder it is in
+        if (wi.m_idx < 0) {
+            wi.m_idx = addToCatalog(wi);
+            added.push_back(wi);
+        }
+        if (!wi.m_folder.isEmpty()) {
+            m_folders.insert(wi.m_idx, wi.m_folder);
+        }
+    }
+    if (added.isEmpty()) {
+        return;
+    }
+    if (m_hierarchical) {
+        // New entries were appended to the order, move them behind the anchor
+        int const at = m_rank[after] + 1;
+        std::rotate(m_order.begin() + at, m_order.begin() + first, m_order.end());
+        for (int pos = at; pos < int(m_order.size()); ++pos) {
+            m_rank[m_order[pos]] = pos;
+        }
+        after = m_order[at + int(added.size()) - 1];
+        if (m_filtering) {
+            sortFiltered();
+        }
+    }
+    m_imageloaderqueue.requestMetadata(added);
+
+    layoutGrid();
+    updateThumbs();
+    nextImage(ImgView::FileDir::none);
+    continueRestore(added);
+}
+
+void ImgView::setHierarchical(bool on) {
+    m_hierarchical = on;
+    QSettings settings("ImgView", "ImgView");
+    settings.setValue("Hierarchical", m_hierarchical);
+
+    // The grid keeps its order, folders opened from now on are listed the new way
+    m_order.clear();
+    m_rank.clear();
+    if (m_hierarchical) {
+        m_order.resize(m_catalog.size());
+        std::iota(m_order.begin(), m_order.end(), 0);
+        m_rank = m_order;
+    } else if (m_filtering) {
+        std::sort(m_filtered.begin(), m_filtered.end());
+    }
+    if (m_filtering) {
+        sortFiltered();
+    }
+    layoutGrid();
+    setTransform();
+    update();
+}
+
+void ImgView::loadedCatalog(QList<CatalogEntry> ces) {
+    if (ces.isEmpty() || ces.front().wi.m_cancel.isCancelled()) {
+        return;
+    }
+
+    QList<WorkItem> listed;
+    listed.reserve(ces.size());
+    for (auto &ce : ces) {
+        int const idx = addToCatalog(ce.wi);
+        ce.wi.m_idx = idx;
+        listed.push_back(ce.wi);
+        m_catalog.setImageSize(idx, ce.size);
+        // Every row has a stored thumbnail, the visible ones are requested by updateThumbs
+        m_thumbcount++;
     }
 
+    m_imageloaderqueue.requestMetadata(listed);
+
+    layoutGrid();
+    setTransform();
     nextImage(ImgView::FileDir::none);
+    // Pages arrive faster than thumbnails, keep the budget while the catalog grows
+    trimThumbs();
+}
+
+int ImgView::addToCatalog(WorkItem const &wi) {
+    int const idx = m_catalog.append(wi);
+    m_search.add(m_catalog, idx);
+    if (m_hierarchical) {
+        m_rank.push_back(int(m_order.size()));
+        m_order.push_back(idx);
+    }
+    if (m_filtering) {
+        // New entries that match the active search are appended to the filtered grid
+        bool const match = TrigramIndex::matches(m_catalog, idx, m_filter);
+        m_position.push_back(match ? int(m_filtered.size()) : -1);
+        if (match) {
+            m_filtered.push_back(idx);
+        }
+    }
+    return idx;
+}
+
+void ImgView::setFilter(QString const &text) {
+    if (text == m_filter) {
+        return;
+    }
+    {
+        Bench::Scope const bench(QStringLiteral(u"gui.search"));
+        m_filter = text;
+        m_filtering = !text.isEmpty();
+        m_filtered.clear();
+        m_position.clear();
+        if (m_filtering) {
+            m_filtered = m_search.find(m_catalog, text);
+            m_position.assign(m_catalog.size(), -1);
+            sortFiltered();
+        }
+    }
+
+    // Stay on the main image while it matches, otherwise go to the first match
+    if (positionOf(m_mainImage) < 0) {
+        m_mainImage = cellCount() > 0 ? catalogIndex(0) : -1;
+    }
+    layoutGrid();
+    autofit();
+    setTitle();
+}
+
+void ImgView::sortFiltered() {
+    // Matches come in catalog order, a hierarchical grid has its own
+    if (m_hierarchical) {
+        std::sort(m_filtered.begin(), m_filtered.end(), [this](int a, int b) { return m_rank[a] < m_rank[b]; });
+    }
+    for (int pos = 0; pos < int(m_filtered.size()); ++pos) {
+        m_position[m_filtered[pos]] = pos;
+    }
+}
+
+void ImgView::showSearch() {
+    m_searchbox->show();
+    m_searchbox->raise();
+    m_searchbox->setFocus();
+    m_searchbox->selectAll();
+}
+
+void ImgView::hideSearch() {
+    m_searchbox->clear();
+    m_searchbox->hide();
+    setFocus();
+}
+
+void ImgView::layoutGrid() {
+    // Square grid, the position of each cell follows from its index
+    m_xdim = std::ceil(std::sqrt(cellCount()));
 }
 
 int mapIdxToRange(int idx, int range) {
@@ -332,63 +1041,403 @@ int mapIdxToRange(int idx, int range) {
 }
 
 void ImgView::nextImage(FileDir fd) {
-    if (m_allImages.isEmpty()) {
+    if (cellCount() == 0) {
         return;
     }
-    if (m_mainImage == 0) {
-        m_mainImage = m_allImages[0];
+    if (positionOf(m_mainImage) < 0) {
+        m_mainImage = catalogIndex(0);
     }
 
     if (fd != FileDir::none) {
-        int const nextidx = fitincircularrange((fd == FileDir::next) ? m_mainImage->idx() + 1 : m_mainImage->idx() - 1, m_allImages.size());
-        m_mainImage = m_allImages[nextidx];
+        int const pos = positionOf(m_mainImage);
+        m_mainImage = catalogIndex(fitincircularrange((fd == FileDir::next) ? pos + 1 : pos - 1, cellCount()));
+        // Preloading worked if the full image is already there
+        Bench::count(m_catalog.image(m_mainImage) ? QStringLiteral(u"cache.image.hit") : QStringLiteral(u"cache.image.miss"));
+        if (Bench::enabled()) {
+            m_nexttoimage.start();
+        }
         autofit();
     } else {
         update();
     }
 
+    if (m_animation && m_animation_idx != m_mainImage) {
+        stopAnimation();
+    }
+
+    // Stepping onto a folder lists it, the next step goes into it
+    expandFolder(m_mainImage);
+
     // Set Title to new filename
     setTitle();
 
     // Cache next Images
-    if (m_mainImage) {
-        int const current_image = m_mainImage->idx();
-        int const constexpr images_to_cache = 3;
-        for (auto &ii : m_allImages) {
-            int dist = std::abs(ii->idx() - current_image);
-            dist = std::min(dist, (int) m_allImages.size() - dist);
-            ii->preloadNext(dist < images_to_cache);
+    updateBigImages();
+}
+
+void ImgView::updateBigImages() {
+    // Full images are kept for the neighbours of the main image and for visible cells
+    // that are shown larger than a thumbnail
+    QSet<int> want;
+    int const mainpos = positionOf(m_mainImage);
+    if (mainpos >= 0) {
+        int const images_to_cache = m_governor.preloadDepth(3);
+        for (int d = 1 - images_to_cache; d < images_to_cache; ++d) {
+            want.insert(catalogIndex(fitincircularrange(mainpos + d, cellCount())));
+        }
+    }
+    if (m_transform.m11() > 256 && m_governor.level() != MemoryGovernor::critical) {
+        QRect const cells = visibleCells();
+        for (int y = cells.top(); y <= cells.bottom(); ++y) {
+            for (int x = cells.left(); x <= cells.right(); ++x) {
+                int const pos = y * m_xdim + x;
+                if (pos < cellCount()) {
+                    want.insert(catalogIndex(pos));
+                }
+            }
+        }
+    }
+
+    for (auto it = m_bigimages.begin(); it != m_bigimages.end();) {
+        if (!want.contains(*it)) {
+            m_catalog.releaseImage(*it);
+            it = m_bigimages.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (int idx : std::as_const(want)) {
+        if (!m_bigimages.contains(idx)) {
+            m_bigimages.insert(idx);
+            WorkItem wi = m_catalog.workItem(idx);
+            wi.loadimage = true;
+            wi.loadthumb = !m_catalog.thumb(idx);
+            m_imageloaderqueue.insert(wi);
+        }
+    }
+}
+
+void ImgView::updateThumbs() {
+    // Visible cells get the thumbnail level that matches their size on screen: small ones
+    // when zoomed out, larger ones only when zoomed in
+    int const level = ThumbLevel::forCell(m_transform.m11() * devicePixelRatioF());
+    QRect const cells = visibleCells();
+    QRectF const ahead = predictedRect();
+    m_predicted = cellsIn(ahead);
+    int const aheadlevel = m_predicted.isEmpty() ? level : ThumbLevel::forCell(width() / ahead.width() * devicePixelRatioF());
+    if (!m_thumbregions.isEmpty()) {
+        int const constexpr margin = 2;
+        dropStaleThumbs(cells.adjusted(-margin, -margin, margin, margin).united(m_predicted));
+    }
+    // Unlisted folders shown at least this large (in pixels) are listed
+    int const constexpr expandcell = 128;
+    bool const expand = m_transform.m11() >= expandcell;
+    // Folder covers are requested first, each stands for everything below it
+    for (bool const covers : { true, false }) {
+        if (covers && m_folders.isEmpty()) {
+            continue;
+        }
+        for (int y = cells.top(); y <= cells.bottom(); ++y) {
+            for (int x = cells.left(); x <= cells.right(); ++x) {
+                int const pos = y * m_xdim + x;
+                if (pos >= cellCount()) {
+                    break;
+                }
+                int const idx = catalogIndex(pos);
+                if (m_folders.contains(idx) != covers) {
+                    continue;
+                }
+                if (covers && expand) {
+                    expandFolder(idx);
+                }
+                requestThumb(idx, level, false);
+            }
+        }
+    }
+
+    // Then the cells the view will show a few hundred milliseconds from now, at the level
+    // they will be shown at; they run after everything visible
+    for (int y = m_predicted.top(); y <= m_predicted.bottom(); ++y) {
+        for (int x = m_predicted.left(); x <= m_predicted.right(); ++x) {
+            int const pos = y * m_xdim + x;
+            if (pos >= cellCount()) {
+                break;
+            }
+            if (!cells.contains(x, y)) {
+                requestThumb(catalogIndex(pos), aheadlevel, true);
+            }
+        }
+    }
+}
+
+void ImgView::requestThumb(int idx, int level, bool prefetch) {
+    if (m_thumbrequests.contains(idx)) {
+        return;
+    }
+    QPixmap const *thumb = m_catalog.thumb(idx);
+    if (thumb && m_settle_timer.isActive()) {
+        // Swapping levels costs a lookup and maybe five encodes, wait until the view settles
+        return;
+    }
+    int const have = thumb ? ThumbLevel::extent(thumb->size()) : 0;
+    int const full = ThumbLevel::extent(m_catalog.imageSize(idx));
+    bool const toosmall = have < level && (full <= 0 || full > have);
+    bool const toolarge = have > 2 * level;
+    if (toosmall || toolarge) {
+        int const pos = positionOf(idx);
+        int const xdim = std::max(1, m_xdim);
+        QPoint const region(pos % xdim / ThumbRegion::cells, pos / xdim / ThumbRegion::cells);
+        ThumbRegion &pending = m_thumbregions[region];
+        pending.requests.insert(idx);
+        m_thumbrequests.insert(idx, region);
+        WorkItem wi = m_catalog.workItem(idx);
+        wi.loadthumb = true;
+        wi.m_level = level;
+        wi.m_prefetch = prefetch;
+        wi.m_storeonly = m_storeonly;
+        wi.m_cancel = pending.cancel.token();
+        m_imageloaderqueue.insert(wi);
+    }
+}
+
+void ImgView::dropStaleThumbs(QRect const &wanted) {
+    // Only regions entirely outside of what is wanted are cancelled, so requests for visible
+    // cells keep running. A region keeps the cells of when it was requested; if a relayout
+    // makes it drop a cell still wanted, that one is requested again right after.
+    int const constexpr cells = ThumbRegion::cells;
+    for (auto it = m_thumbregions.begin(); it != m_thumbregions.end();) {
+        if (QRect(it.key() * cells, QSize(cells, cells)).intersects(wanted)) {
+            ++it;
+            continue;
+        }
+        it->cancel.cancel();
+        for (int idx : std::as_const(it->requests)) {
+            m_thumbrequests.remove(idx);
+        }
+        Bench::count(QStringLiteral(u"thumbs.dropped"), it->requests.size());
+        it = m_thumbregions.erase(it);
+    }
+}
+
+void ImgView::thumbRequestDone(int idx) {
+    auto const request = m_thumbrequests.constFind(idx);
+    if (request == m_thumbrequests.cend()) {
+        return;
+    }
+    auto const region = m_thumbregions.find(request.value());
+    if (region != m_thumbregions.end()) {
+        region->requests.remove(idx);
+        if (region->requests.isEmpty()) {
+            m_thumbregions.erase(region);
+        }
+    }
+    m_thumbrequests.erase(request);
+}
+
+void ImgView::trackMotion() {
+    // Velocity from the transform and not from the input events, so dragging, wheel zoom
+    // and keyboard scrolling are all covered
+    int const constexpr idlems = 200;
+    QPointF const center = m_transform.inverted().map(QRectF(rect()).center());
+    double const scale = m_transform.m11();
+    qint64 const elapsed = m_motionclock.isValid() ? m_motionclock.restart() : -1;
+    if (!m_motionclock.isValid()) {
+        m_motionclock.start();
+    }
+    QSizeF const viewport = QSizeF(size()) / std::max(scale, 1e-9);
+    QPointF const jump = center - m_lastcenter;
+    if (elapsed <= 0 || elapsed > idlems || m_lastscale <= 0. || scale <= 0. || std::abs(jump.x()) > viewport.width() || std::abs(jump.y()) > viewport.height()) {
+        // Started moving, or jumped (resize, autofit, next image): no velocity yet
+        m_velocity = QPointF();
+        m_zoomrate = 0.;
+    } else {
+        double const constexpr smoothing = 0.5;
+        double const seconds = elapsed / 1000.;
+        m_velocity = smoothing * m_velocity + (1. - smoothing) * jump / seconds;
+        m_zoomrate = smoothing * m_zoomrate + (1. - smoothing) * std::log(scale / m_lastscale) / seconds;
+    }
+    m_lastcenter = center;
+    m_lastscale = scale;
+}
+
+QRectF ImgView::predictedRect() const {
+    int const constexpr idlems = 200;
+    double const constexpr lookahead = 0.3;
+    if (!m_motionclock.isValid() || m_motionclock.elapsed() > idlems || (m_velocity.isNull() && m_zoomrate == 0.)) {
+        return QRectF();
+    }
+    QRectF const now = m_transform.inverted().mapRect(QRectF(rect()));
+    // Zooming in shrinks the logical rectangle, zooming out grows it; bounded so a fast
+    // zoom out does not prefetch half the listing
+    double const grow = std::max(0.5, std::min(2., std::exp(-m_zoomrate * lookahead)));
+    QRectF ahead(QPointF(), now.size() * grow);
+    ahead.moveCenter(now.center() + m_velocity * lookahead);
+    return ahead;
+}
+
+qint64 ImgView::thumbBudget() const {
+    QSettings const settings("ImgView", "ImgView");
+    return qint64(std::max<qint64>(1, settings.value("ThumbMemoryMB", 512).toLongLong()) * 1024 * 1024 * m_governor.budgetFactor());
+}
+
+void ImgView::trimThumbs() {
+    qint64 const budget = thumbBudget();
+    if (m_catalog.thumbBytes() <= budget) {
+        return;
+    }
+    Bench::Scope const bench(QStringLiteral(u"gui.trimThumbs"));
+
+    // Filtered out and farthest from the viewport first, visible cells are never evicted.
+    // Trimming down to three quarters of the budget keeps this from running on every
+    // adopted thumbnail.
+    QRect const cells = visibleCells();
+    std::vector<std::pair<int, int>> candidates;
+    candidates.reserve(m_catalog.residentThumbs().size());
+    for (int idx : m_catalog.residentThumbs()) {
+        int const pos = positionOf(idx);
+        if (pos < 0) {
+            candidates.emplace_back(std::numeric_limits<int>::max(), idx);
+            continue;
+        }
+        int const x = pos % std::max(1, m_xdim);
+        int const y = pos / std::max(1, m_xdim);
+        int const dx = std::max({ cells.left() - x, x - cells.right(), 0 });
+        int const dy = std::max({ cells.top() - y, y - cells.bottom(), 0 });
+        if (dx > 0 || dy > 0 || cells.isEmpty()) {
+            candidates.emplace_back(std::max(dx, dy), idx);
         }
     }
+    std::sort(candidates.begin(), candidates.end(), std::greater<>());
+
+    int evicted = 0;
+    for (auto const &[distance, idx] : candidates) {
+        if (m_catalog.thumbBytes() <= budget * 3 / 4) {
+            break;
+        }
+        m_catalog.releaseThumb(idx);
+        evicted++;
+    }
+    Bench::count(QStringLiteral(u"thumbs.evicted"), evicted);
+    qDebug() << "evicted" << evicted << "thumbnails," << m_catalog.residentThumbs().size() << "resident with" << m_catalog.thumbBytes() / 1024 << "kB";
 }
 
 void ImgView::setTitle() {
-    if (m_mainImage) {
-        ImageItem &is = *m_mainImage;
+    if (m_mainImage >= 0) {
+        int const idx = m_mainImage;
         emit message(QStringLiteral(u"%1 %2 (%3/%4/%5) (%6x%7 %8kB)")
-                         .arg(is.imageinfo().fi.fileName())
-                         .arg(is.imageinfo().fi.absoluteFilePath())
-                         .arg(is.idx() + 1)
+                         .arg(m_catalog.fileName(idx))
+                         .arg(m_catalog.filePath(idx))
+                         .arg(positionOf(idx) + 1)
                          .arg(m_thumbcount)
-                         .arg(m_allImages.size())
-                         .arg(is.size.width())
-                         .arg(is.size.height())
-                         .arg(is.imageinfo().fi.size() / (1024)));
+                         .arg(cellCount())
+                         .arg(m_catalog.imageSize(idx).width())
+                         .arg(m_catalog.imageSize(idx).height())
+                         .arg(m_catalog.filesize(idx) / (1024)));
     }
 }
 
 void ImgView::clearImages() {
-    m_allImages.clear();
-    m_mainImage = nullptr;
+    // Everything still queued or running for the old listing stops at its next check
+    m_imageloaderqueue.cancel();
+    stopAnimation();
+    // An export reads the catalog as it goes, it does not outlive the listing
+    delete m_contactsheet;
+    m_contactsheet = nullptr;
+    m_loaded.clear();
+    m_deferred_listing.clear();
+    m_catalog.clear();
+    m_bigimages.clear();
+    m_thumbrequests.clear();
+    m_thumbregions.clear();
+    m_predicted = QRect();
+    m_motionclock.invalidate();
+    m_sources.clear();
+    m_revalidation.clear();
+    m_search.clear();
+    m_filter.clear();
+    m_filtering = false;
+    m_filtered.clear();
+    m_position.clear();
+    m_folders.clear();
+    m_expanding = 0;
+    m_pendingview.reset();
+    m_order.clear();
+    m_rank.clear();
+    if (!m_searchbox->text().isEmpty()) {
+        QSignalBlocker const block(m_searchbox);
+        m_searchbox->clear();
+    }
+    m_mainImage = -1;
+    m_xdim = 0;
     m_thumbcount = 0;
+    m_listing = false;
+    m_storeonly = false;
+    if (Bench::enabled()) {
+        m_opentothumbs.start();
+    }
 }
 
 void ImgView::closeEvent(QCloseEvent *event) {
-    QThreadPool::globalInstance()->waitForDone();
+    // Queued work finds its token cancelled and returns, running decodes fail at their next
+    // read. What is left gets a bounded wait, the database only writes what was queued.
+    int const constexpr budget = 50;
+    QElapsedTimer ti;
+    ti.start();
+    saveSession();
+    stopAnimation();
+    // An unfinished contact sheet is discarded
+    delete m_contactsheet;
+    m_contactsheet = nullptr;
+    m_imageloaderqueue.cancel();
+    if (!ImagePipeline::instance().waitForDone(budget)) {
+        qDebug() << "leaving running tasks behind";
+    }
+    m_imageloaderqueue.shutdown(budget);
+    Bench::record(QStringLiteral(u"gui.close"), ti.nsecsElapsed());
+    Bench::report();
     event->accept();
 }
 
-void ImgView::openDatabase() {}
+void ImgView::openDatabase() {
+    clearImages();
+    m_storeonly = true;
+    DatabaseIteratorTask *dbt = new DatabaseIteratorTask;
+    dbt->setCancelToken(m_imageloaderqueue.token());
+    connect(dbt, &DatabaseIteratorTask::loadedCatalog, this, &ImgView::loadedCatalog);
+    ImagePipeline::instance().enumerate.start(dbt);
+}
+
+void ImgView::exportContactSheet() {
+    QSettings settings("ImgView", "ImgView");
+    QString const filename = QFileDialog::getSaveFileName(this, QStringLiteral(u"Export Contact Sheet"), settings.value("LastDirectory", "").toString(),
+                                                          QStringLiteral(u"PNG (*.png);;TIFF (*.tif *.tiff)"));
+    if (filename.isEmpty()) {
+        return;
+    }
+    bool ok = false;
+    int const cellsize = QInputDialog::getInt(this, QStringLiteral(u"Export Contact Sheet"), QStringLiteral(u"Cell size in pixels"),
+                                              settings.value("ContactSheetCell", 256).toInt(), 32, ThumbLevel::sizes.back(), 16, &ok);
+    if (!ok) {
+        return;
+    }
+    settings.setValue("ContactSheetCell", cellsize);
+
+    // The grid as shown: same order, same columns, search applied
+    std::vector<int> cells(size_t(cellCount()));
+    for (int pos = 0; pos < cellCount(); ++pos) {
+        cells[size_t(pos)] = catalogIndex(pos);
+    }
+    m_contactsheet = new ContactSheet(m_catalog, std::move(cells), m_xdim, cellsize, filename, m_imageloaderqueue.store(), this);
+    connect(m_contactsheet, &ContactSheet::progress, this, [this](int rows) {
+        emit message(QStringLiteral(u"Contact sheet: %1 of %2 rows").arg(rows).arg(m_contactsheet->rows()));
+    });
+    connect(m_contactsheet, &ContactSheet::finished, this, [this](bool, QString text) {
+        emit message(text);
+        m_contactsheet->deleteLater();
+        m_contactsheet = nullptr;
+    });
+    m_contactsheet->start();
+}
 
 void ImgView::setTransform() {
     m_transform.reset();
@@ -397,15 +1446,17 @@ void ImgView::setTransform() {
     m_transform.scale(m_zoom, m_zoom);
     m_transform.translate(-center.x(), -center.y());
 
-    QRectF const logicalRect = m_transform.inverted().mapRect(QRectF(this->rect()));
-    for (auto &ii : m_allImages) {
-        ii->setVisible(ii->thumbrect().intersects(logicalRect));
-    }
+    trackMotion();
+    m_settle_timer.start();
+    updateBigImages();
+    updateThumbs();
 }
 
 void ImgView::customContextMenu(QPoint pos) {
     QMenu *menu = new QMenu(this);
     menu->addAction(QStringLiteral(u"Load Image"), [this]() { loadImage(QStringList()); });
+    QAction *sheet = menu->addAction(QStringLiteral(u"Export Contact Sheet..."), this, &ImgView::exportContactSheet);
+    sheet->setEnabled(cellCount() > 0 && !m_contactsheet);
     menu->popup(mapToGlobal(pos));
 }
 
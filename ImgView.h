@@ -2,17 +2,28 @@
 #include <QDirIterator>
 #include <QDragEnterEvent>
 #include <QDropEvent>
+#include <QElapsedTimer>
 #include <QFileDialog>
+#include <QLineEdit>
 #include <QMenu>
 #include <QMouseEvent>
 #include <QMutex>
 #include <QPushButton>
+#include <QQueue>
 #include <QRunnable>
+#include <QSet>
 #include <QTimer>
 #include <QWidget>
+#include <optional>
 
-#include "ImageItem.h"
+#include "AnimationPlayer.h"
+#include "CancelToken.h"
+#include "ContactSheet.h"
+#include "DatabaseIteratorTask.h"
+#include "ImageCatalog.h"
 #include "ImageLoaderQueue.h"
+#include "MemoryGovernor.h"
+#include "TrigramIndex.h"
 
 inline constexpr int fitincircularrange(int i, int size) {
   int r = i % size;
@@ -31,11 +42,16 @@ public:
   void autofit();
   void loadImage(QStringList filename);
   void openFolder(QString dir);
+  // Reopens the listing and view of the last run, false if there is nothing to restore
+  bool restoreSession();
   void loaded(WorkItem info);
   void loadedFilenames(QList<WorkItem> is);
+  void loadedCatalog(QList<CatalogEntry> ces);
   void loadedImage(WorkItem wi, QImage img, QImage thumb, QSize si);
+  void loadedMetadata(QList<WorkItem> wis, QList<ImageMetadata> mds);
 
   protected:
+  bool event(QEvent *event) override;
   void paintEvent(QPaintEvent *) override;
   void mouseMoveEvent(QMouseEvent *event) override;
   void mousePressEvent(QMouseEvent *event) override;
@@ -54,17 +70,83 @@ signals:
 
 private:
   void customContextMenu(QPoint pos);
-  void getFiles(QStringList filenames, QDirIterator::IteratorFlag itf);
+  void getFiles(QStringList filenames, QDirIterator::IteratorFlag itf, bool listed = false);
+  void showFirst(QString filename);
+  void saveSession();
+  void saveListing();
+  void revalidated();
+  void restoreView(QString const &mainfile, double zoom, QPointF offset, QString const &filter);
+  void continueRestore(QList<WorkItem> const &listed = QList<WorkItem>());
+  int indexOf(QString const &path) const;
+  void startupFrame(bool preview);
+  void startAnimation(int idx);
+  void stopAnimation();
   void btnWheelZoomIconUpdate();
   void nextImage(FileDir fd);
   void setTitle();
   void clearImages();
   void setTransform();
+  void layoutGrid();
+  int addToCatalog(WorkItem const &wi);
+  void expandFolder(int idx);
+  void listedFolder(int &after, QList<WorkItem> is);
+  void setHierarchical(bool on);
+  void sortFiltered();
+  void setFilter(QString const &text);
+  void showSearch();
+  void hideSearch();
+  // Grid positions cover the search matches while filtering, the whole catalog otherwise
+  int cellCount() const;
+  int catalogIndex(int pos) const;
+  int positionOf(int idx) const;
+  void updateBigImages();
+  void updateThumbs();
+  void requestThumb(int idx, int level, bool prefetch);
+  void dropStaleThumbs(QRect const &wanted);
+  void thumbRequestDone(int idx);
+  void trackMotion();
+  QRectF predictedRect() const;
+  void trimThumbs();
+  qint64 thumbBudget() const;
+  void drawItem(QPainter &p, int idx, bool undermouse);
+  void drawOriented(QPainter &p, QRectF cell, QPixmap const &pixmap, int orientation);
+  QRectF cellRect(int idx) const;
+  QRect visibleCells() const;
+  QRect cellsIn(QRectF const &logicalRect) const;
+  int indexAt(QPointF logicalpos) const;
   void openDatabase();
+  void exportContactSheet();
+  void adoptLoadedImages();
 
-  QList<ImageItem *> m_allImages;
-  ImageItem *m_mainImage = nullptr;
+  struct LoadedImage {
+    WorkItem wi;
+    QImage img, thumb;
+    QSize si;
+  };
+
+  ImageCatalog m_catalog;
+  int m_mainImage = -1;
+  int m_xdim = 0;
+  QSet<int> m_bigimages;
+  // Pending thumbnail requests by the block of grid cells they were made for. Each block
+  // has its own cancel source, a block the view has left is cancelled as a whole.
+  struct ThumbRegion {
+    static int constexpr cells = 8;
+    CancelSource cancel;
+    QSet<int> requests;
+  };
+  QHash<int, QPoint> m_thumbrequests; // catalog index -> region
+  QHash<QPoint, ThumbRegion> m_thumbregions;
+  // Pan (logical cells per second) and zoom (log scale per second) velocity of the view,
+  // smoothed over the last transform changes; cells it is heading to are prefetched
+  QPointF m_velocity;
+  double m_zoomrate = 0.;
+  QPointF m_lastcenter;
+  double m_lastscale = 0.;
+  QElapsedTimer m_motionclock;
+  QRect m_predicted;
   ImageLoaderQueue m_imageloaderqueue;
+  MemoryGovernor m_governor;
   QSizeF m_visibleImage_size;
   QMutex m_allImage_mutex;
   QVector<QPushButton *> m_buttons;
@@ -81,4 +163,46 @@ private:
   bool m_show_thumb = false;
   bool m_antialiase = false;
   int m_thumbcount = 0;
+  QQueue<LoadedImage> m_loaded;
+  QTimer m_adopt_timer;
+  // Runs while the view pans or zooms; thumbnails at the wrong level are swapped once it stops
+  QTimer m_settle_timer;
+  QStringList m_deferred_listing;
+  QStringList m_startup_marks;
+  QElapsedTimer m_inputtoframe;
+  // What was listed, saved with the session and listed again to revalidate it
+  QStringList m_sources;
+  QList<WorkItem> m_revalidation;
+  QElapsedTimer m_nexttoimage;
+  // From opening a listing until the whole listing is in and every visible cell has its thumbnail
+  QElapsedTimer m_opentothumbs;
+  bool m_listing = false;
+  // Browsing the thumbnail database, thumbnails and metadata never come from the files
+  bool m_storeonly = false;
+  bool m_coldstart = true;
+  AnimationPlayer *m_animation = nullptr;
+  int m_animation_idx = -1;
+  TrigramIndex m_search;
+  QString m_filter;
+  bool m_filtering = false;
+  std::vector<int> m_filtered; // position -> catalog index
+  std::vector<int> m_position; // catalog index -> position, -1 when filtered out
+  QLineEdit *m_searchbox = nullptr;
+  ContactSheet *m_contactsheet = nullptr;
+  // Hierarchical listing: a subfolder shows as its cover image until it is listed, its
+  // files then go in right after the cover
+  bool m_hierarchical = false;
+  QHash<int, QString> m_folders; // cover catalog index -> folder not listed yet
+  std::vector<int> m_order; // position -> catalog index, only in hierarchical mode
+  std::vector<int> m_rank; // catalog index -> position in m_order
+  int m_expanding = 0; // folders being listed by expandFolder
+  // View of a restored hierarchical session, applied once the folders down to its main
+  // file are listed
+  struct PendingView {
+    QString mainfile;
+    double zoom = 1.;
+    QPointF offset;
+    QString filter;
+  };
+  std::optional<PendingView> m_pendingview;
 };
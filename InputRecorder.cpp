@@ -0,0 +1,95 @@
+#include "InputRecorder.h"
+#include <QCoreApplication>
+#include <QDebug>
+#include <QKeyEvent>
+#include <QMouseEvent>
+#include <QResizeEvent>
+#include <QWheelEvent>
+#include <QWidget>
+
+InputRecorder::InputRecorder(QWidget *widget, QString const &filename)
+    : QObject(widget)
+    , m_file(filename) {
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        qWarning() << "Cannot record input to" << filename << m_file.errorString();
+        return;
+    }
+    m_out.setDevice(&m_file);
+    m_clock.start();
+    m_out << 0 << " resize " << widget->width() << ' ' << widget->height() << '\n';
+    widget->installEventFilter(this);
+}
+
+bool InputRecorder::eventFilter(QObject *watched, QEvent *event) {
+    qint64 const ms = m_clock.elapsed();
+    switch (event->type()) {
+    case QEvent::KeyPress:
+    case QEvent::KeyRelease: {
+        auto const *e = static_cast<QKeyEvent *>(event);
+        m_out << ms << " key " << (e->type() == QEvent::KeyPress ? "press " : "release ") << e->key() << ' ' << int(e->modifiers()) << '\n';
+        break;
+    }
+    case QEvent::Wheel: {
+        auto const *e = static_cast<QWheelEvent *>(event);
+        m_out << ms << " wheel " << e->position().x() << ' ' << e->position().y() << ' ' << e->angleDelta().x() << ' ' << e->angleDelta().y()
+              << ' ' << int(e->buttons()) << ' ' << int(e->modifiers()) << '\n';
+        break;
+    }
+    case QEvent::MouseButtonPress:
+    case QEvent::MouseButtonRelease:
+    case QEvent::MouseButtonDblClick:
+    case QEvent::MouseMove: {
+        auto const *e = static_cast<QMouseEvent *>(event);
+        char const *kind = (e->type() == QEvent::MouseButtonPress)     ? "press "
+                           : (e->type() == QEvent::MouseButtonRelease) ? "release "
+                           : (e->type() == QEvent::MouseButtonDblClick) ? "double "
+                                                                        : "move ";
+        m_out << ms << " mouse " << kind << e->position().x() << ' ' << e->position().y() << ' ' << int(e->button()) << ' ' << int(e->buttons())
+              << ' ' << int(e->modifiers()) << '\n';
+        break;
+    }
+    case QEvent::Resize: {
+        auto const *e = static_cast<QResizeEvent *>(event);
+        m_out << ms << " resize " << e->size().width() << ' ' << e->size().height() << '\n';
+        break;
+    }
+    default:
+        break;
+    }
+    return QObject::eventFilter(watched, event);
+}
+
+qint64 InputRecorder::timestamp(QString const &line) {
+    bool ok = false;
+    qint64 const ms = line.section(' ', 0, 0).toLongLong(&ok);
+    return ok ? ms : -1;
+}
+
+void InputRecorder::replay(QWidget *widget, QString const &line) {
+    QStringList const f = line.split(' ', Qt::SkipEmptyParts);
+    auto const num = [&f](int i) { return f.value(i).toDouble(); };
+    if (f.size() < 2) {
+        return;
+    }
+    QString const &type = f[1];
+    if (type == QLatin1String("key") && f.size() >= 5) {
+        QKeyEvent e(f[2] == QLatin1String("press") ? QEvent::KeyPress : QEvent::KeyRelease, int(num(3)), Qt::KeyboardModifiers(int(num(4))));
+        QCoreApplication::sendEvent(widget, &e);
+    } else if (type == QLatin1String("wheel") && f.size() >= 8) {
+        QPointF const pos(num(2), num(3));
+        QWheelEvent e(pos, widget->mapToGlobal(pos), QPoint(), QPoint(int(num(4)), int(num(5))), Qt::MouseButtons(int(num(6))),
+                      Qt::KeyboardModifiers(int(num(7))), Qt::NoScrollPhase, false);
+        QCoreApplication::sendEvent(widget, &e);
+    } else if (type == QLatin1String("mouse") && f.size() >= 8) {
+        QEvent::Type const t = (f[2] == QLatin1String("press"))    ? QEvent::MouseButtonPress
+                               : (f[2] == QLatin1String("release")) ? QEvent::MouseButtonRelease
+                               : (f[2] == QLatin1String("double"))  ? QEvent::MouseButtonDblClick
+                                                                    : QEvent::MouseMove;
+        QPointF const pos(num(3), num(4));
+        QMouseEvent e(t, pos, widget->mapToGlobal(pos), Qt::MouseButton(int(num(5))), Qt::MouseButtons(int(num(6))),
+                      Qt::KeyboardModifiers(int(num(7))));
+        QCoreApplication::sendEvent(widget, &e);
+    } else if (type == QLatin1String("resize") && f.size() >= 4) {
+        widget->resize(int(num(2)), int(num(3)));
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <QElapsedTimer>
+#include <QFile>
+#include <QObject>
+#include <QString>
+#include <QTextStream>
+
+class QWidget;
+
+// Writes the input a widget receives to a text file, one event per line with the
+// milliseconds since recording started:
+//   <ms> key <press|release> <key> <modifiers>
+//   <ms> wheel <x> <y> <angle dx> <angle dy> <buttons> <modifiers>
+//   <ms> mouse <press|release|double|move> <x> <y> <button> <buttons> <modifiers>
+//   <ms> resize <width> <height>
+// ImgView records when IMGVIEW_RECORD names the file, ImgViewReplay plays it back.
+class InputRecorder : public QObject {
+    Q_OBJECT
+public:
+    InputRecorder(QWidget *widget, QString const &filename);
+
+    // Time stamp of a recorded line, -1 if it is not an event
+    static qint64 timestamp(QString const &line);
+    // Sends the event of a recorded line to the widget
+    static void replay(QWidget *widget, QString const &line);
+
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
+private:
+    QFile m_file;
+    QTextStream m_out;
+    QElapsedTimer m_clock;
+};
@@ -7,13 +7,15 @@ class MainWindow : public QMainWindow {
 	Q_OBJECT
 public:
 	MainWindow(QStringList filenames) {
-		ImgView* view = new ImgView(this);
-		setCentralWidget(view);
-		connect(view, &ImgView::message, [this](QString msg) {
+		m_view = new ImgView(this);
+		setCentralWidget(m_view);
+		connect(m_view, &ImgView::message, [this](QString msg) {
             setWindowTitle(QStringLiteral(u"'%1' - ImgView").arg(msg));
 			});
 		if(!filenames.isEmpty()){
-			view->loadImage(filenames);
+			m_view->loadImage(filenames);
+		} else {
+			m_view->restoreSession();
 		}
 
 		QIcon* ie = new QIcon(new IconEngine);
@@ -27,11 +29,16 @@ public:
 		}
 	}
 
-    void resizeEvent(QResizeEvent* event){
+    // Window size and session are saved once on close instead of on every resize
+    void closeEvent(QCloseEvent* event) override {
         QSettings settings("ImgView", "ImgView");
         QSize size = this->size();
         settings.setValue("WindowWidth", size.width());
         settings.setValue("WindowHeight", size.height());
-        QMainWindow::resizeEvent(event);
+        m_view->close();
+        QMainWindow::closeEvent(event);
     }
+
+private:
+    ImgView* m_view = nullptr;
 };
\ No newline at end of file
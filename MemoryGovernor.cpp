@@ -0,0 +1,169 @@
+#include "MemoryGovernor.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QImageReader>
+#include <QSettings>
+#include <algorithm>
+
+#include "Bench.h"
+#include "ImageBufferPool.h"
+#include "ImagePipeline.h"
+
+namespace {
+int const constexpr pollms = 1000;
+// Polls below the current level before relaxing by one
+int const constexpr calmpolls = 5;
+// Share of time (percent, last 10 s) some or all tasks stalled on memory
+double const constexpr elevatedsome = 5.;
+double const constexpr criticalsome = 20.;
+double const constexpr criticalfull = 5.;
+
+QByteArray readFile(QString const &path) {
+    QFile file(path);
+    return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray();
+}
+
+qint64 readNumber(QString const &path) {
+    bool ok = false;
+    qint64 const value = readFile(path).trimmed().toLongLong(&ok);
+    return ok ? value : -1;
+}
+
+// avg10 of the "some" or "full" line of a PSI file
+double stall(QByteArray const &psi, QByteArray const &kind) {
+    for (auto const &line : psi.split('\n')) {
+        if (!line.startsWith(kind + ' ')) {
+            continue;
+        }
+        for (auto const &field : line.split(' ')) {
+            if (field.startsWith("avg10=")) {
+                return field.mid(6).toDouble();
+            }
+        }
+    }
+    return 0.;
+}
+}
+
+MemoryGovernor::MemoryGovernor(QObject *parent)
+    : QObject(parent)
+    , m_decodethreads(ImagePipeline::instance().decode.threads())
+    , m_poolbudget(ImageBufferPool::instance().budget()) {
+    QSettings const settings("ImgView", "ImgView");
+    m_elevated = settings.value("Memory/ElevatedPercent", 75).toDouble() / 100.;
+    m_critical = settings.value("Memory/CriticalPercent", 90).toDouble() / 100.;
+#ifdef Q_OS_LINUX
+    if (!settings.value("Memory/Governor", true).toBool()) {
+        return;
+    }
+    m_cgroup = findCgroup();
+    m_pressure = (!m_cgroup.isEmpty() && QFile::exists(m_cgroup + "/memory.pressure")) ? m_cgroup + "/memory.pressure" : QStringLiteral(u"/proc/pressure/memory");
+    if (!m_cgroup.isEmpty()) {
+        // A single image may take at most a quarter of the limit
+        qint64 limitmb = std::max<qint64>(64, readNumber(m_cgroup + "/memory.max") / 4 / (1024 * 1024));
+        if (QImageReader::allocationLimit() > 0) {
+            limitmb = std::min<qint64>(limitmb, QImageReader::allocationLimit());
+        }
+        QImageReader::setAllocationLimit(int(limitmb));
+        qDebug() << "memory limit from" << m_cgroup << "image allocation limit" << QImageReader::allocationLimit() << "MB";
+    }
+    connect(&m_timer, &QTimer::timeout, this, &MemoryGovernor::poll);
+    m_timer.start(pollms);
+#endif
+}
+
+QString MemoryGovernor::findCgroup() {
+    // "0::/user.slice/..." is the cgroup v2 entry; the nearest ancestor with a limit applies
+    for (auto const &line : readFile(QStringLiteral(u"/proc/self/cgroup")).split('\n')) {
+        if (!line.startsWith("0::")) {
+            continue;
+        }
+        QString path = QString::fromUtf8(line.mid(3));
+        while (true) {
+            QString const dir = QDir::cleanPath(QStringLiteral(u"/sys/fs/cgroup") + path);
+            if (readNumber(dir + "/memory.max") > 0) {
+                return dir;
+            }
+            if (path.isEmpty() || path == QStringLiteral(u"/")) {
+                break;
+            }
+            path = path.left(std::max(0, int(path.lastIndexOf('/'))));
+        }
+    }
+    return QString();
+}
+
+double MemoryGovernor::budgetFactor() const {
+    switch (m_level) {
+    case elevated:
+        return 0.5;
+    case critical:
+        return 0.25;
+    default:
+        return 1.;
+    }
+}
+
+int MemoryGovernor::preloadDepth(int normal) const {
+    // 1 keeps only the main image
+    return std::max(1, normal - int(m_level));
+}
+
+MemoryGovernor::Level MemoryGovernor::measure() const {
+    Level level = normal;
+    if (!m_cgroup.isEmpty()) {
+        // Clean file cache is dropped by the kernel before anything is killed, do not count it
+        qint64 const max = readNumber(m_cgroup + "/memory.max");
+        qint64 used = readNumber(m_cgroup + "/memory.current");
+        for (auto const &line : readFile(m_cgroup + "/memory.stat").split('\n')) {
+            if (line.startsWith("inactive_file ")) {
+                used -= line.mid(14).toLongLong();
+            }
+        }
+        if (max > 0 && used > 0) {
+            double const usage = double(used) / double(max);
+            level = (usage >= m_critical) ? critical : (usage >= m_elevated) ? elevated : normal;
+        }
+    }
+    QByteArray const psi = readFile(m_pressure);
+    double const some = stall(psi, "some");
+    double const full = stall(psi, "full");
+    if (some >= criticalsome || full >= criticalfull) {
+        level = critical;
+    } else if (some >= elevatedsome) {
+        level = std::max(level, elevated);
+    }
+    return level;
+}
+
+void MemoryGovernor::poll() {
+    Level const measured = measure();
+    if (measured > m_level) {
+        m_level = measured;
+        m_calm = 0;
+        apply();
+    } else if (measured < m_level) {
+        if (++m_calm >= calmpolls) {
+            m_level = Level(m_level - 1);
+            m_calm = 0;
+            apply();
+        }
+    } else {
+        m_calm = 0;
+    }
+}
+
+void MemoryGovernor::apply() {
+    qInfo() << "memory pressure level" << m_level;
+    static char16_t const *const names[] = { u"memory.normal", u"memory.elevated", u"memory.critical" };
+    Bench::count(QString::fromUtf16(names[m_level]));
+
+    // Every decode worker holds a full image, fewer of them hold less
+    int const threads = (m_level == critical) ? 1 : (m_level == elevated) ? std::max(1, m_decodethreads / 2) : m_decodethreads;
+    ImagePipeline::instance().decode.setThreads(threads);
+    // Idle pixel buffers are the first thing to give back
+    ImageBufferPool::instance().setBudget((m_level == normal) ? m_poolbudget : 0);
+
+    emit levelChanged(m_level);
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <QObject>
+#include <QString>
+#include <QTimer>
+
+// Watches how close the process is to running out of memory and tells the caches and
+// worker pools to back off. On Linux it reads the nearest cgroup v2 limit (memory.max
+// against memory.current minus reclaimable file cache) and memory pressure stall
+// information (the cgroup's memory.pressure, or /proc/pressure/memory). Elsewhere the
+// level stays normal.
+// Rising pressure is acted on at the next poll, it is only relaxed one level at a time
+// after staying lower for a few seconds, so the caches do not flap.
+// Settings group "Memory": Governor (default true), ElevatedPercent (75) and
+// CriticalPercent (90) of the cgroup limit.
+class MemoryGovernor : public QObject {
+    Q_OBJECT
+public:
+    enum Level { normal, elevated, critical };
+
+    explicit MemoryGovernor(QObject *parent = nullptr);
+
+    Level level() const { return m_level; }
+    // Share of the configured cache budgets to use at the current level
+    double budgetFactor() const;
+    // Neighbours of the main image to keep decoded, given the depth at normal level
+    int preloadDepth(int normal) const;
+
+signals:
+    void levelChanged(MemoryGovernor::Level level);
+
+private:
+    void poll();
+    void apply();
+    Level measure() const;
+    static QString findCgroup();
+
+    QTimer m_timer;
+    QString m_cgroup;
+    QString m_pressure;
+    Level m_level = normal;
+    int m_calm = 0;
+    int m_decodethreads;
+    qint64 m_poolbudget;
+    double m_elevated;
+    double m_critical;
+};
@@ -0,0 +1,115 @@
+#include "ParallelImage.h"
+#include <QImageReader>
+#include <QPainter>
+#include <QtConcurrent>
+#include <cstring>
+
+#include "Bench.h"
+#include "CancellableBuffer.h"
+#include "ImageBufferPool.h"
+#include "ImagePipeline.h"
+
+QList<QRect> ParallelImage::bands(QSize size, int align) {
+    // Two bands per thread evens out bands that take longer than others
+    int const count = std::max(1, ImagePipeline::instance().bands.threads() * 2);
+    int height = (size.height() + count - 1) / count;
+    height = (height + align - 1) / align * align;
+
+    QList<QRect> result;
+    for (int y = 0; y < size.height(); y += height) {
+        result.push_back(QRect(0, y, size.width(), std::min(height, size.height() - y)));
+    }
+    return result;
+}
+
+bool ParallelImage::decode(QByteArray const &data, QImage &image, QString &error, CancelToken const &cancel) {
+    // Fails the decode at its next read once cancelled, so shutdown does not wait for large images
+    CancellableBuffer buffer(data, cancel);
+    QImageReader reader(&buffer);
+    // Pixels stay as stored, the view applies the EXIF orientation when drawing
+    reader.setAutoTransform(false);
+
+    if (cancel.isCancelled()) {
+        error = QStringLiteral(u"Cancelled");
+        return false;
+    }
+    // Handlers decode into the image they are given when size and format match
+    QSize const size = reader.size();
+    QImage::Format const format = reader.imageFormat();
+    if (size.isValid() && format != QImage::Format_Invalid) {
+        image = ImageBufferPool::instance().image(size, format);
+    }
+    if (!reader.read(&image)) {
+        error = reader.errorString();
+        return false;
+    }
+    return true;
+}
+
+QImage ParallelImage::convert(QImage const &src, QImage::Format format) {
+    if (src.format() == format || src.isNull()) {
+        return src;
+    }
+    if (qint64(src.width()) * src.height() < minpixels) {
+        return src.convertToFormat(format);
+    }
+
+    Bench::Scope const bench(QStringLiteral(u"image.convert"));
+    QImage dst = ImageBufferPool::instance().image(src.size(), format);
+    if (dst.isNull()) {
+        return src.convertToFormat(format);
+    }
+    uchar *const dstbits = dst.bits();
+    uchar const *const srcbits = src.constBits();
+    qsizetype const dstbpl = dst.bytesPerLine();
+    qsizetype const srcbpl = src.bytesPerLine();
+    QList<QRgb> const colors = src.colorTable();
+
+    QList<QRect> parts = bands(src.size(), 1);
+    QtConcurrent::blockingMap(ImagePipeline::instance().bands.pool(), parts, [&](QRect const &band) {
+        // Views on the bands of both images, no pixels are copied twice
+        QImage view(srcbits + band.y() * srcbpl, band.width(), band.height(), srcbpl, src.format());
+        view.setColorTable(colors);
+        QImage const converted = view.convertToFormat(format);
+        qsizetype const rowbytes = std::min(dstbpl, converted.bytesPerLine());
+        for (int y = 0; y < converted.height(); ++y) {
+            std::memcpy(dstbits + (band.y() + y) * dstbpl, converted.constScanLine(y), rowbytes);
+        }
+    });
+    dst.setDevicePixelRatio(src.devicePixelRatio());
+    return dst;
+}
+
+QImage ParallelImage::displayReady(QImage const &src) {
+    return convert(src, src.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+}
+
+QImage ParallelImage::scaled(QImage const &src, QSize size, Qt::TransformationMode mode) {
+    QSize const target = src.size().scaled(size, Qt::KeepAspectRatio);
+    if (target.isEmpty() || qint64(src.width()) * src.height() < minpixels) {
+        return src.scaled(size, Qt::KeepAspectRatio, mode);
+    }
+
+    Bench::Scope const bench(QStringLiteral(u"image.scale"));
+    // QPainter needs a raster format to paint into
+    QImage::Format const format = src.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32;
+    QImage dst(target, format);
+    if (dst.isNull()) {
+        return src.scaled(size, Qt::KeepAspectRatio, mode);
+    }
+    uchar *const dstbits = dst.bits();
+    qsizetype const dstbpl = dst.bytesPerLine();
+
+    QList<QRect> parts = bands(target, 1);
+    QtConcurrent::blockingMap(ImagePipeline::instance().bands.pool(), parts, [&](QRect const &band) {
+        QImage view(dstbits + band.y() * dstbpl, band.width(), band.height(), dstbpl, format);
+        if (format == QImage::Format_ARGB32_Premultiplied) {
+            view.fill(Qt::transparent);
+        }
+        QPainter p(&view);
+        p.setCompositionMode(QPainter::CompositionMode_Source);
+        p.setRenderHint(QPainter::SmoothPixmapTransform, mode == Qt::SmoothTransformation);
+        p.drawImage(QRectF(0, -band.y(), target.width(), target.height()), src);
+    });
+    return dst;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <QByteArray>
+#include <QImage>
+#include <QRect>
+#include <QString>
+
+#include "CancelToken.h"
+
+// Splits the work on one large image into horizontal bands that run on the "bands" stage
+// of the ImagePipeline, so converting and scaling a single huge image can use every core.
+// Decoding is not split: Qt's handlers decode every row above a clip rect in full, so a
+// reader per band would cost a full decode for the last band alone.
+class ParallelImage {
+public:
+    // Decodes with one reader into a buffer from the ImageBufferPool
+    static bool decode(QByteArray const &data, QImage &image, QString &error, CancelToken const &cancel = CancelToken());
+
+    // Row band format conversion
+    static QImage convert(QImage const &src, QImage::Format format);
+
+    // Converts to the format the raster paint engine draws without conversion, so the GUI
+    // thread can adopt the buffer in QPixmap::fromImage instead of converting it
+    static QImage displayReady(QImage const &src);
+
+    // Row band scaling, each band paints its part of the destination
+    static QImage scaled(QImage const &src, QSize size, Qt::TransformationMode mode = Qt::FastTransformation);
+
+    // Below this many pixels splitting costs more than it saves
+    static qint64 const constexpr minpixels = 4 * 1024 * 1024;
+
+private:
+    static QList<QRect> bands(QSize size, int align);
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <functional>
+#include <memory>
+
+#include "CancelToken.h"
+
+// Hands results from pool jobs back to a QObject on its own thread. Jobs hold the relay and
+// not the object; the object detaches it before it goes away, so a job finishing late drops
+// its result instead of posting to a deleted object.
+template <typename T>
+class Relay {
+public:
+    explicit Relay(T *target)
+        : m_target(target) {}
+
+    // Only on the target's thread; waits for a job that is just posting its result
+    void detach() {
+        QMutexLocker lock(&m_mutex);
+        m_target = nullptr;
+    }
+
+    bool attached() {
+        QMutexLocker lock(&m_mutex);
+        return m_target != nullptr;
+    }
+
+    // False when nothing was posted
+    static bool deliver(std::shared_ptr<Relay> const &relay, CancelToken const &token, std::function<void(T *)> fn) {
+        QMutexLocker lock(&relay->m_mutex);
+        // Cancelled results are not wanted any more, the target may be going away
+        if (!relay->m_target || token.isCancelled()) {
+            return false;
+        }
+        QMetaObject::invokeMethod(relay->m_target, [relay, fn = std::move(fn)]() {
+            // Runs on the target's thread, which is also the one that detaches it
+            if (relay->m_target) {
+                fn(relay->m_target);
+            }
+        }, Qt::QueuedConnection);
+        return true;
+    }
+
+private:
+    QMutex m_mutex;
+    T *m_target;
+};
@@ -0,0 +1,171 @@
+#include "ReplayRunner.h"
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QImageReader>
+#include <QLinearGradient>
+#include <QLoggingCategory>
+#include <QPainter>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QTimer>
+#include <QtConcurrent>
+
+#include "Bench.h"
+#include "ImageHashStore.h"
+#include "ImgView.h"
+#include "InputRecorder.h"
+
+ReplayRunner::ReplayRunner(QStringList lines, QString corpus, int settlems)
+    : m_lines(std::move(lines))
+    , m_corpus(std::move(corpus))
+    , m_settlems(settlems) {
+}
+
+ReplayRunner::~ReplayRunner() {
+    delete m_view;
+}
+
+bool ReplayRunner::generateCorpus(QString const &folder, int count, QSize size) {
+    QDir const dir(folder);
+    if (!dir.mkpath(QStringLiteral(u"."))) {
+        return false;
+    }
+    QList<int> missing;
+    for (int i = 0; i < count; ++i) {
+        if (!dir.exists(QStringLiteral(u"img%1.jpg").arg(i, 5, 10, QLatin1Char('0')))) {
+            missing.push_back(i);
+        }
+    }
+    // Gradients with a large number: cheap to make, and every image decodes differently
+    QtConcurrent::blockingMap(missing, [&](int i) {
+        QImage image(size, QImage::Format_RGB32);
+        QPainter p(&image);
+        QLinearGradient gradient(0, 0, size.width(), size.height());
+        gradient.setColorAt(0, QColor::fromHsv((i * 37) % 360, 200, 230));
+        gradient.setColorAt(1, QColor::fromHsv((i * 37 + 180) % 360, 200, 60));
+        p.fillRect(image.rect(), gradient);
+        QFont font = p.font();
+        font.setPixelSize(size.height() / 3);
+        p.setFont(font);
+        p.setPen(Qt::white);
+        p.drawText(image.rect(), Qt::AlignCenter, QString::number(i));
+        p.end();
+        image.save(dir.filePath(QStringLiteral(u"img%1.jpg").arg(i, 5, 10, QLatin1Char('0'))), "JPEG", 90);
+    });
+    return true;
+}
+
+void ReplayRunner::start() {
+    m_view = new ImgView;
+    m_view->resize(800, 600);
+    m_view->show();
+
+    // Like a user opening the first file of a folder
+    QStringList const files = QDir(m_corpus).entryList(QStringList{ QStringLiteral(u"*.jpg") }, QDir::Files, QDir::Name);
+    if (files.isEmpty()) {
+        qWarning() << "No images in" << m_corpus;
+        emit finished(1);
+        return;
+    }
+    m_view->loadImage(QStringList{ QDir(m_corpus).filePath(files.front()) });
+
+    m_clock.start();
+    next();
+}
+
+void ReplayRunner::next() {
+    while (m_next < m_lines.size()) {
+        qint64 const due = InputRecorder::timestamp(m_lines[m_next]);
+        qint64 const now = m_clock.elapsed();
+        if (due > now) {
+            QTimer::singleShot(int(due - now), this, &ReplayRunner::next);
+            return;
+        }
+        // Sent this much after its recorded time because the event loop was busy
+        if (due >= 0) {
+            Bench::record(QStringLiteral(u"replay.lag"), (now - due) * 1000 * 1000);
+        }
+        InputRecorder::replay(m_view, m_lines[m_next]);
+        m_next++;
+    }
+    // Give the last loads time to land before the report
+    QTimer::singleShot(m_settlems, this, &ReplayRunner::done);
+}
+
+void ReplayRunner::done() {
+    QTextStream(stdout) << QStringLiteral(u"replayed %1 events in %2 ms").arg(m_lines.size()).arg(m_clock.elapsed()) << Qt::endl;
+    // Waits for the pipeline and prints the Bench report
+    m_view->close();
+    emit finished(0);
+}
+
+int main(int argc, char *argv[]) {
+    // Runs without a display unless a platform is chosen explicitly, always with the timers on
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    qputenv("IMGVIEW_BENCH", "1");
+    Bench::start();
+    QApplication app(argc, argv);
+    QCoreApplication::setOrganizationName(QStringLiteral("ImgView"));
+    QCoreApplication::setApplicationName(QStringLiteral("ImgView"));
+    // Same 1 GB per image as the viewer
+    QImageReader::setAllocationLimit(1024);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral(u"Replays an ImgView input recording (IMGVIEW_RECORD) against a synthetic corpus and reports frame timing."));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral(u"recording"), QStringLiteral(u"Recorded input file."));
+    QCommandLineOption corpusOption(QStringLiteral(u"corpus"), QStringLiteral(u"Folder of the synthetic corpus, generated if missing (default: in the temp folder)."), QStringLiteral(u"folder"));
+    QCommandLineOption imagesOption(QStringLiteral(u"images"), QStringLiteral(u"Images in the corpus (default: 300)."), QStringLiteral(u"n"), QStringLiteral(u"300"));
+    QCommandLineOption sizeOption(QStringLiteral(u"size"), QStringLiteral(u"Image size (default: 4000x3000)."), QStringLiteral(u"wxh"), QStringLiteral(u"4000x3000"));
+    QCommandLineOption dbOption(QStringLiteral(u"db"), QStringLiteral(u"Thumbnail database (default: a new one, i.e. a cold cache)."), QStringLiteral(u"file"));
+    QCommandLineOption settleOption(QStringLiteral(u"settle"), QStringLiteral(u"Milliseconds to wait after the last event (default: 2000)."), QStringLiteral(u"ms"), QStringLiteral(u"2000"));
+    QCommandLineOption verboseOption(QStringLiteral(u"verbose"), QStringLiteral(u"Print debug output."));
+    parser.addOptions({ corpusOption, imagesOption, sizeOption, dbOption, settleOption, verboseOption });
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1) {
+        parser.showHelp(2);
+    }
+    if (!parser.isSet(verboseOption)) {
+        QLoggingCategory::setFilterRules(QStringLiteral(u"*.debug=false"));
+    }
+
+    QFile file(parser.positionalArguments().front());
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << "Cannot read" << file.fileName() << file.errorString();
+        return 1;
+    }
+    QStringList lines;
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        if (QString const line = in.readLine(); InputRecorder::timestamp(line) >= 0) {
+            lines.push_back(line);
+        }
+    }
+
+    QStringList const wh = parser.value(sizeOption).split('x');
+    QSize const size(wh.value(0).toInt(), wh.value(1).toInt());
+    int const images = std::max(1, parser.value(imagesOption).toInt());
+    if (size.isEmpty()) {
+        parser.showHelp(2);
+    }
+    QString const corpus = parser.isSet(corpusOption)
+                               ? parser.value(corpusOption)
+                               : QDir::temp().filePath(QStringLiteral(u"ImgViewReplay-%1-%2x%3").arg(images).arg(size.width()).arg(size.height()));
+    if (!ReplayRunner::generateCorpus(corpus, images, size)) {
+        qWarning() << "Cannot create corpus in" << corpus;
+        return 1;
+    }
+
+    QTemporaryDir dbdir;
+    ImageHashStore::setDatabasePath(parser.isSet(dbOption) ? parser.value(dbOption) : dbdir.filePath(QStringLiteral(u"thumbs.db")));
+
+    ReplayRunner runner(lines, corpus, std::max(0, parser.value(settleOption).toInt()));
+    QObject::connect(&runner, &ReplayRunner::finished, &app, &QCoreApplication::exit, Qt::QueuedConnection);
+    QTimer::singleShot(0, &runner, &ReplayRunner::start);
+    return app.exec();
+}
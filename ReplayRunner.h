@@ -0,0 +1,38 @@
+#pragma once
+#include <QElapsedTimer>
+#include <QObject>
+#include <QSize>
+#include <QStringList>
+
+class ImgView;
+
+// Plays an input recording (see InputRecorder) into an ImgView opened on a synthetic
+// corpus, on the offscreen platform. Every event is sent at its recorded time; how late
+// that happens shows how long the GUI thread was busy. The Bench report at the end holds
+// frame times, input to frame latency, the time from nextImage to the full image and the
+// cache hit counters.
+class ReplayRunner : public QObject {
+    Q_OBJECT
+public:
+    ReplayRunner(QStringList lines, QString corpus, int settlems);
+    ~ReplayRunner();
+
+    // Writes count deterministic JPEGs of the given size into folder, unless already there
+    static bool generateCorpus(QString const &folder, int count, QSize size);
+
+    void start();
+
+signals:
+    void finished(int exitcode);
+
+private:
+    void next();
+    void done();
+
+    QStringList m_lines;
+    QString m_corpus;
+    int m_settlems;
+    qsizetype m_next = 0;
+    ImgView *m_view = nullptr;
+    QElapsedTimer m_clock;
+};
@@ -0,0 +1,112 @@
+#include "Session.h"
+#include <QDataStream>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSaveFile>
+
+#include "ImageCatalog.h"
+#include "ImageHashStore.h"
+
+namespace {
+quint32 const constexpr magic = 0x494d5653; // "IMVS"
+quint32 const constexpr version = 2;
+}
+
+QString Session::path() {
+    return QFileInfo(ImageHashStore::databasePath()).absolutePath() + "/session.dat";
+}
+
+QString Session::listingPath() {
+    return QFileInfo(ImageHashStore::databasePath()).absolutePath() + "/session.listing";
+}
+
+WorkItem Session::workItem(Entry const &entry) const {
+    WorkItem wi;
+    wi.fi = QFileInfo(dirs.value(entry.dir) + '/' + entry.name);
+    wi.m_hash = entry.hash;
+    wi.m_filesize = entry.filesize;
+    return wi;
+}
+
+bool Session::save() const {
+    QSaveFile file(path());
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot save session:" << file.errorString();
+        return false;
+    }
+    QDataStream out(&file);
+    out << magic << version << sources << mainfile << zoom << offset << filter;
+    return out.status() == QDataStream::Ok && file.commit();
+}
+
+bool Session::saveListing(QStringList const &sources, ImageCatalog::Listing const &listing) {
+    static QMutex mutex;
+    QMutexLocker lock(&mutex);
+    QSaveFile file(listingPath());
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Cannot save listing:" << file.errorString();
+        return false;
+    }
+    QDataStream out(&file);
+    size_t const count = listing.dir.size();
+    out << magic << version << sources << listing.dirs << quint64(count);
+    for (size_t i = 0; i < count; ++i) {
+        quint32 const begin = listing.nameoffset[i];
+        quint32 const end = (i + 1 < count) ? listing.nameoffset[i + 1] : quint32(listing.names.size());
+        // Same layout as Entry, read back by load()
+        out << listing.dir[i] << listing.names.mid(begin, end - begin) << listing.filesize[i]
+            << QByteArray::fromRawData(listing.hash[i].data(), qsizetype(listing.hash[i].size()));
+    }
+    return out.status() == QDataStream::Ok && file.commit();
+}
+
+bool Session::load() {
+    QFile file(path());
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QDataStream in(&file);
+    quint32 m = 0, v = 0;
+    quint64 count = 0;
+    in >> m >> v;
+    if (m != magic || v != version) {
+        return false;
+    }
+    in >> sources >> mainfile >> zoom >> offset >> filter;
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    // Without a listing of the same sources they are listed again
+    dirs.clear();
+    entries.clear();
+    QFile listing(listingPath());
+    if (!listing.open(QIODevice::ReadOnly)) {
+        return true;
+    }
+    in.setDevice(&listing);
+    QStringList listed;
+    in >> m >> v >> listed;
+    if (m != magic || v != version || listed != sources) {
+        return true;
+    }
+    in >> dirs >> count;
+    entries.reserve(std::min<quint64>(count, 1 << 20));
+    for (quint64 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        Entry e;
+        in >> e.dir >> e.name >> e.filesize >> e.hash;
+        entries.push_back(std::move(e));
+    }
+    if (in.status() != QDataStream::Ok) {
+        dirs.clear();
+        entries.clear();
+    }
+    return true;
+}
+
+void Session::remove() {
+    QFile::remove(path());
+    QFile::remove(listingPath());
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <QByteArray>
+#include <QPointF>
+#include <QString>
+#include <QStringList>
+#include <vector>
+
+#include "ImageCatalog.h"
+#include "WorkItem.h"
+
+// What was open when the viewer was closed: the sources that were listed, the view and a
+// snapshot of the listing with the keys of all files. Restoring it shows the previous
+// listing without touching the file system, the keys find the thumbnails in thumbs.db.
+// The view is written to session.dat next to thumbs.db on close. The listing grows with
+// the folders, so it goes to session.listing when a listing completes: the GUI thread only
+// copies the catalog's arrays, the entries are written on the encode stage. It is only
+// used while its sources match the view's.
+struct Session {
+    QStringList sources;
+    QString mainfile;
+    double zoom = 1.;
+    QPointF offset;
+    QString filter;
+    QStringList dirs;
+    struct Entry {
+        quint32 dir = 0;
+        QString name;
+        qint64 filesize = -1;
+        QByteArray hash;
+    };
+    std::vector<Entry> entries;
+
+    static QString path();
+    static QString listingPath();
+    WorkItem workItem(Entry const &entry) const;
+    bool save() const;
+    // Thread safe, a listing that completes while the previous one is written waits
+    static bool saveListing(QStringList const &sources, ImageCatalog::Listing const &listing);
+    bool load();
+    static void remove();
+};
@@ -0,0 +1,271 @@
+#include "ThumbCacheJanitor.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QSettings>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+
+#include "ArchiveIndex.h"
+#include "ImageHashStore.h"
+
+namespace {
+int const constexpr batchsize = 256;
+int const constexpr vacuumpages = 1024;
+// Missing files get this long to turn up again under a new path and adopt their row by fingerprint
+qint64 const constexpr movegraceseconds = 14 * 24 * 60 * 60;
+// Metadata without a thumbnail is kept this long after its file was last listed
+qint64 const constexpr metadataseconds = 30 * 24 * 60 * 60;
+}
+
+ThumbCacheJanitor::ThumbCacheJanitor(QObject *parent)
+    : QObject(parent) {
+}
+
+ThumbCacheJanitor::~ThumbCacheJanitor() {
+    if (db.isOpen()) {
+        db.close();
+    }
+}
+
+qint64 ThumbCacheJanitor::sizeLimit() {
+    QSettings const settings("ImgView", "ImgView");
+    return settings.value("ThumbCacheLimitMB", 2048).toLongLong() * 1024 * 1024;
+}
+
+void ThumbCacheJanitor::setSizeLimit(qint64 bytes) {
+    QSettings settings("ImgView", "ImgView");
+    settings.setValue("ThumbCacheLimitMB", bytes / (1024 * 1024));
+}
+
+void ThumbCacheJanitor::init() {
+    db = QSqlDatabase::addDatabase("QSQLITE", "ThumbCacheJanitorConnection");
+    db.setDatabaseName(ImageHashStore::databasePath());
+    if (!db.open()) {
+        qDebug() << db.lastError().nativeErrorCode();
+        return;
+    }
+
+    QSqlQuery pragma(db);
+    pragma.exec("PRAGMA busy_timeout=5000;");
+
+    // First pass once startup I/O has settled, then every half hour
+    m_timer = new QTimer(this);
+    m_timer->setInterval(30 * 60 * 1000);
+    connect(m_timer, &QTimer::timeout, this, &ThumbCacheJanitor::collect);
+    m_timer->start();
+    QTimer::singleShot(30 * 1000, this, &ThumbCacheJanitor::collect);
+}
+
+void ThumbCacheJanitor::collect() {
+    if (!db.isOpen()) {
+        return;
+    }
+
+    QElapsedTimer ti;
+    ti.start();
+    removeOrphans();
+    removeOrphanMetadata();
+    evictLeastRecentlyUsed();
+    vacuum();
+    qDebug() << "thumb cache janitor finished in" << ti.elapsed() << "ms";
+}
+
+bool ThumbCacheJanitor::interrupted() const {
+    return QThread::currentThread()->isInterruptionRequested();
+}
+
+bool ThumbCacheJanitor::compact() {
+    bool ok = false;
+    {
+        QSqlDatabase compactdb = QSqlDatabase::addDatabase("QSQLITE", "ThumbCacheCompactConnection");
+        compactdb.setDatabaseName(ImageHashStore::databasePath());
+        if (!compactdb.open()) {
+            qWarning() << "Open for compact failed:" << compactdb.lastError().text();
+        } else {
+            QSqlQuery query(compactdb);
+            query.exec("PRAGMA busy_timeout=5000;");
+            query.exec("PRAGMA auto_vacuum=INCREMENTAL;");
+            ok = query.exec("VACUUM");
+            if (!ok) {
+                qWarning() << "Vacuum failed:" << query.lastError().text();
+            }
+            compactdb.close();
+        }
+    }
+    QSqlDatabase::removeDatabase("ThumbCacheCompactConnection");
+    return ok;
+}
+
+qint64 ThumbCacheJanitor::pragmaValue(QString const &pragma) {
+    QSqlQuery query(db);
+    if (query.exec(QStringLiteral(u"PRAGMA %1").arg(pragma)) && query.next()) {
+        return query.value(0).toLongLong();
+    }
+    return -1;
+}
+
+void ThumbCacheJanitor::removeOrphans() {
+    QSqlQuery select(db), remove(db);
+    select.setForwardOnly(true);
+    select.prepare("SELECT rowid, hash, filepath, lastaccess FROM images WHERE rowid > :rowid ORDER BY rowid LIMIT :limit");
+    remove.prepare("DELETE FROM images WHERE rowid = :rowid");
+
+    qint64 const graceexpired = QDateTime::currentSecsSinceEpoch() - movegraceseconds;
+    qint64 lastrowid = -1;
+    int removed = 0;
+    while (!interrupted()) {
+        select.bindValue(":rowid", lastrowid);
+        select.bindValue(":limit", batchsize);
+        if (!select.exec()) {
+            qWarning() << "Orphan scan failed:" << select.lastError().text();
+            return;
+        }
+
+        // Check the files outside of any transaction, the stat calls are the slow part
+        QList<qint64> orphans;
+        int rows = 0;
+        while (select.next()) {
+            rows++;
+            lastrowid = select.value(0).toLongLong();
+            QFileInfo fi(select.value(2).toString());
+            QString archive, member;
+            if (!fi.exists() && ArchiveIndex::split(fi.absoluteFilePath(), archive, member)) {
+                // Archive member, its key changes with the archive. Members of a deleted
+                // archive look like files in a missing folder and are left to the size limit.
+                if (ImageHashStore::memberKeyFor(QFileInfo(archive), member) != select.value(1).toByteArray()) {
+                    orphans.push_back(lastrowid);
+                }
+                continue;
+            }
+            if (fi.exists()) {
+                // Edited in place: the key no longer matches size and mtime
+                if (ImageHashStore::keyFor(fi) != select.value(1).toByteArray()) {
+                    orphans.push_back(lastrowid);
+                }
+            } else if (fi.dir().exists() && select.value(3).toLongLong() < graceexpired) {
+                // Deleted, or renamed and not opened since. If the folder is gone too the
+                // file may sit on a drive that is offline, leave those to the size limit.
+                orphans.push_back(lastrowid);
+            }
+        }
+        select.finish();
+
+        if (!orphans.isEmpty()) {
+            db.transaction();
+            for (qint64 rowid : std::as_const(orphans)) {
+                remove.bindValue(":rowid", rowid);
+                remove.exec();
+            }
+            db.commit();
+            removed += orphans.size();
+        }
+
+        if (rows < batchsize) {
+            break;
+        }
+    }
+    qDebug() << "thumb cache janitor removed" << removed << "orphans";
+}
+
+void ThumbCacheJanitor::removeOrphanMetadata() {
+    // Metadata is written for every listed file, thumbnailed or not, and its key goes stale
+    // when the file is edited or moved. Rows with an images row go with it, the rest expire.
+    QSqlQuery select(db), remove(db);
+    select.setForwardOnly(true);
+    select.prepare("SELECT hash, lastaccess < :expired AND NOT EXISTS (SELECT 1 FROM images WHERE images.hash = metadata.hash) "
+                   "FROM metadata WHERE hash > :hash ORDER BY hash LIMIT :limit");
+    remove.prepare("DELETE FROM metadata WHERE hash = :hash");
+
+    qint64 const expired = QDateTime::currentSecsSinceEpoch() - metadataseconds;
+    QByteArray lasthash("");
+    int removed = 0;
+    while (!interrupted()) {
+        select.bindValue(":expired", expired);
+        select.bindValue(":hash", lasthash);
+        select.bindValue(":limit", batchsize);
+        if (!select.exec()) {
+            qWarning() << "Metadata scan failed:" << select.lastError().text();
+            return;
+        }
+        QList<QByteArray> orphans;
+        int rows = 0;
+        while (select.next()) {
+            rows++;
+            lasthash = select.value(0).toByteArray();
+            if (select.value(1).toBool()) {
+                orphans.push_back(lasthash);
+            }
+        }
+        select.finish();
+
+        if (!orphans.isEmpty()) {
+            db.transaction();
+            for (auto const &hash : std::as_const(orphans)) {
+                remove.bindValue(":hash", hash);
+                remove.exec();
+            }
+            db.commit();
+            removed += orphans.size();
+        }
+
+        if (rows < batchsize) {
+            break;
+        }
+    }
+    qDebug() << "thumb cache janitor removed" << removed << "metadata rows";
+}
+
+void ThumbCacheJanitor::evictLeastRecentlyUsed() {
+    qint64 const limit = sizeLimit();
+    if (limit <= 0) {
+        return;
+    }
+
+    QSqlQuery evict(db);
+    evict.prepare("DELETE FROM images WHERE rowid IN (SELECT rowid FROM images ORDER BY lastaccess LIMIT :limit)");
+
+    int evicted = 0;
+    while (!interrupted()) {
+        qint64 const pagesize = pragmaValue("page_size");
+        qint64 const used = (pragmaValue("page_count") - pragmaValue("freelist_count")) * pagesize;
+        if (pagesize <= 0 || used <= limit) {
+            break;
+        }
+
+        evict.bindValue(":limit", batchsize);
+        if (!evict.exec()) {
+            qWarning() << "Evict failed:" << evict.lastError().text();
+            break;
+        }
+        if (evict.numRowsAffected() <= 0) {
+            break;
+        }
+        evicted += evict.numRowsAffected();
+    }
+    qDebug() << "thumb cache janitor evicted" << evicted << "thumbnails";
+}
+
+void ThumbCacheJanitor::vacuum() {
+    if (pragmaValue("auto_vacuum") != 2) {
+        // Created before incremental vacuum was enabled. Converting would hold the write
+        // lock for a rewrite of the whole file, that is left to ImgViewThumbs --compact;
+        // the freed pages are still reused for new thumbnails.
+        qDebug() << "thumb cache janitor: database not converted to incremental vacuum, run ImgViewThumbs --compact";
+        return;
+    }
+
+    // Release free pages a chunk at a time to keep each write lock short
+    QSqlQuery query(db);
+    while (!interrupted() && pragmaValue("freelist_count") > 0) {
+        if (!query.exec(QStringLiteral(u"PRAGMA incremental_vacuum(%1)").arg(vacuumpages))) {
+            qWarning() << "Incremental vacuum failed:" << query.lastError().text();
+            break;
+        }
+        while (query.next()) {
+        }
+    }
+}
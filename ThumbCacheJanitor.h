@@ -0,0 +1,38 @@
+#pragma once
+#include <QObject>
+#include <QSqlDatabase>
+#include <QTimer>
+
+// Keeps thumbs.db bounded: drops rows whose file was edited or deleted, evicts the least
+// recently used thumbnails above the configured size and hands freed pages back to the
+// filesystem. Runs on its own low priority thread and its own connection, and works in
+// small transactions so the lookups of the ImageHashStore never wait for it.
+// Databases created before incremental vacuum are only trimmed by deleting rows, their file
+// does not shrink until they are converted offline with compact().
+class ThumbCacheJanitor : public QObject {
+    Q_OBJECT
+public:
+    explicit ThumbCacheJanitor(QObject *parent = nullptr);
+    ~ThumbCacheJanitor();
+
+    static qint64 sizeLimit();
+    static void setSizeLimit(qint64 bytes);
+    // Switches the database to incremental vacuum with one full VACUUM. That rewrites the
+    // whole file under the write lock, so only run it while nothing else has it open.
+    static bool compact();
+
+public slots:
+    void init();
+    void collect();
+
+private:
+    void removeOrphans();
+    void removeOrphanMetadata();
+    void evictLeastRecentlyUsed();
+    void vacuum();
+    qint64 pragmaValue(QString const &pragma);
+    bool interrupted() const;
+
+    QSqlDatabase db;
+    QTimer *m_timer = nullptr;
+};
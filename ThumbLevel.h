@@ -0,0 +1,30 @@
+#pragma once
+#include <QSize>
+#include <algorithm>
+#include <array>
+
+// Thumbnails are stored as a pyramid, each level named by its longest side in pixels. The
+// view asks for the smallest level that covers a cell on screen, so a zoomed out grid holds
+// tiny pixmaps and the larger levels are only loaded when zoomed in.
+// The base level lives in images.image, the others in the thumbs table.
+class ThumbLevel {
+public:
+    static constexpr std::array<int, 5> sizes{ 32, 64, 128, 256, 512 };
+    static constexpr int base = 256;
+
+    // Smallest level covering a cell of this many device pixels
+    static constexpr int forCell(double devicepixels) {
+        for (int s : sizes) {
+            if (s >= devicepixels) {
+                return s;
+            }
+        }
+        return sizes.back();
+    }
+
+    static constexpr qsizetype index(int level) {
+        return std::find(sizes.begin(), sizes.end(), level) - sizes.begin();
+    }
+
+    static int extent(QSize size) { return std::max(size.width(), size.height()); }
+};
@@ -0,0 +1,165 @@
+#include "ThumbnailBatch.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QImageReader>
+#include <QLoggingCategory>
+#include <QTextStream>
+#include <QThread>
+
+#include "ImageLoaderTask.h"
+#include "ImagePipeline.h"
+#include "ThumbCacheJanitor.h"
+
+namespace {
+// Pending items, in multiples of the tasks in flight, past which the walk waits
+int const constexpr maxpendingrounds = 4;
+}
+
+ThumbnailBatch::ThumbnailBatch(QStringList roots, int threads)
+    : m_roots(roots) {
+    // Nobody is waiting for a full image here, give the CPU bound stages every core
+    ImagePipeline::instance().decode.setThreads(threads);
+    ImagePipeline::instance().encode.setThreads(std::max(1, threads / 2));
+    // Keep the queue short so the tasks hold a bounded amount of memory
+    m_maxinflight = threads * 4;
+
+    m_store.init();
+
+    m_progress.setInterval(1000);
+    connect(&m_progress, &QTimer::timeout, this, [this]() { report(false); });
+}
+
+void ThumbnailBatch::start() {
+    m_elapsed.start();
+    m_progress.start();
+
+    for (auto const &root : std::as_const(m_roots)) {
+        DirIteratorTask *dit = new DirIteratorTask(QStringList{ root }, QDirIterator::Subdirectories);
+        connect(dit, &DirIteratorTask::loadedFilenames, this, &ThumbnailBatch::loadedFilenames);
+        connect(dit, &DirIteratorTask::finished, this, &ThumbnailBatch::enumerationFinished);
+        dit->setGate(m_gate);
+        m_enumerating++;
+        ImagePipeline::instance().enumerate.start(dit);
+    }
+    checkFinished();
+}
+
+void ThumbnailBatch::loadedFilenames(QList<WorkItem> is) {
+    for (auto &wi : is) {
+        m_scanned++;
+        if (m_store.contains(wi.m_hash)) {
+            m_skipped++;
+            continue;
+        }
+        wi.loadthumb = true;
+        wi.m_keymissed = true;
+        m_pending.enqueue(wi);
+    }
+    // The walk is much faster than the decodes, it waits while a few rounds of tasks are queued
+    if (m_pending.size() > m_maxinflight * maxpendingrounds) {
+        m_gate->close();
+    }
+    startTasks();
+}
+
+void ThumbnailBatch::enumerationFinished() {
+    m_enumerating--;
+    checkFinished();
+}
+
+void ThumbnailBatch::startTasks() {
+    while (m_inflight < m_maxinflight && !m_pending.isEmpty()) {
+        ImageLoaderTask *ilt = new ImageLoaderTask(m_pending.dequeue(), &m_store);
+        connect(ilt, &ImageLoaderTask::loaded, this, &ThumbnailBatch::loadedThumb, Qt::QueuedConnection);
+        connect(ilt, &ImageLoaderTask::loadedThumbData, this, [this](WorkItem wi, QList<QByteArray> levels, QSize si) {
+            m_generated++;
+            m_store.insertThumb(wi, levels, si);
+        }, Qt::QueuedConnection);
+        m_inflight++;
+        ilt->start();
+    }
+    if (m_pending.size() <= m_maxinflight) {
+        m_gate->open();
+    }
+}
+
+void ThumbnailBatch::loadedThumb(WorkItem wi, QImage, QImage thumb, QSize) {
+    m_inflight--;
+    if (thumb.isNull()) {
+        m_failed++;
+        m_errors[wi.m_error_message.isEmpty() ? QStringLiteral(u"unknown error") : wi.m_error_message]++;
+        qWarning().noquote() << "failed" << wi.fi.absoluteFilePath() << wi.m_error_message;
+    }
+    startTasks();
+    checkFinished();
+}
+
+void ThumbnailBatch::checkFinished() {
+    if (m_enumerating > 0 || m_inflight > 0 || !m_pending.isEmpty()) {
+        return;
+    }
+    m_progress.stop();
+    report(true);
+    emit finished(m_failed > 0 ? 1 : 0);
+}
+
+void ThumbnailBatch::report(bool final) {
+    QTextStream out(stdout);
+    qint64 const done = m_scanned - m_skipped - m_pending.size() - m_inflight;
+    m_adopted = done - m_generated - m_failed;
+    double const seconds = std::max(0.001, m_elapsed.elapsed() / 1000.);
+    out << QStringLiteral(u"%1 scanned, %2 cached, %3 generated, %4 adopted, %5 failed, %6 thumbs/s")
+               .arg(m_scanned)
+               .arg(m_skipped)
+               .arg(m_generated)
+               .arg(m_adopted)
+               .arg(m_failed)
+               .arg(m_generated / seconds, 0, 'f', 1)
+        << Qt::endl;
+
+    if (final) {
+        out << QStringLiteral(u"finished in %1 s").arg(seconds, 0, 'f', 1) << Qt::endl;
+        for (auto it = m_errors.cbegin(); it != m_errors.cend(); ++it) {
+            out << QStringLiteral(u"  %1x %2").arg(it.value()).arg(it.key()) << Qt::endl;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setOrganizationName(QStringLiteral("ImgView"));
+    QCoreApplication::setApplicationName(QStringLiteral("ImgView"));
+    // 1 GB, the limit is in megabytes
+    QImageReader::setAllocationLimit(1024);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral(u"Fills the ImgView thumbnail database for the given folders."));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral(u"folders"), QStringLiteral(u"Folders to walk recursively."), QStringLiteral(u"folder..."));
+    QCommandLineOption threadsOption(QStringLiteral(u"threads"), QStringLiteral(u"Worker threads (default: all cores)."), QStringLiteral(u"n"),
+                                     QString::number(QThread::idealThreadCount()));
+    QCommandLineOption dbOption(QStringLiteral(u"db"), QStringLiteral(u"Thumbnail database to fill (default: the viewer's thumbs.db)."), QStringLiteral(u"file"));
+    QCommandLineOption verboseOption(QStringLiteral(u"verbose"), QStringLiteral(u"Print debug output."));
+    QCommandLineOption compactOption(QStringLiteral(u"compact"),
+                                     QStringLiteral(u"Convert the database to incremental vacuum and shrink it, then exit. Close the viewer first."));
+    parser.addOptions({ threadsOption, dbOption, verboseOption, compactOption });
+    parser.process(app);
+
+    if (parser.positionalArguments().isEmpty() && !parser.isSet(compactOption)) {
+        parser.showHelp(2);
+    }
+    if (!parser.isSet(verboseOption)) {
+        QLoggingCategory::setFilterRules(QStringLiteral(u"*.debug=false"));
+    }
+    if (parser.isSet(dbOption)) {
+        ImageHashStore::setDatabasePath(parser.value(dbOption));
+    }
+    if (parser.isSet(compactOption)) {
+        return ThumbCacheJanitor::compact() ? 0 : 1;
+    }
+
+    ThumbnailBatch batch(parser.positionalArguments(), std::max(1, parser.value(threadsOption).toInt()));
+    QObject::connect(&batch, &ThumbnailBatch::finished, &app, &QCoreApplication::exit, Qt::QueuedConnection);
+    QTimer::singleShot(0, &batch, &ThumbnailBatch::start);
+    return app.exec();
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <QElapsedTimer>
+#include <QHash>
+#include <QImage>
+#include <QObject>
+#include <QQueue>
+#include <QStringList>
+#include <QTimer>
+
+#include "DirIteratorTask.h"
+#include "ImageHashStore.h"
+#include "WorkItem.h"
+
+// Headless pre-generation of thumbs.db: walks the given trees and renders every thumbnail
+// that is not cached yet. Keys that are already in the database are skipped, so an
+// interrupted run simply resumes when started again.
+class ThumbnailBatch : public QObject {
+    Q_OBJECT
+public:
+    ThumbnailBatch(QStringList roots, int threads);
+
+    void start();
+
+signals:
+    void finished(int exitcode);
+
+private:
+    void loadedFilenames(QList<WorkItem> is);
+    void loadedThumb(WorkItem wi, QImage img, QImage thumb, QSize si);
+    void enumerationFinished();
+    void startTasks();
+    void checkFinished();
+    void report(bool final);
+
+    ImageHashStore m_store;
+    QStringList m_roots;
+    QQueue<WorkItem> m_pending;
+    std::shared_ptr<EnumerationGate> m_gate = std::make_shared<EnumerationGate>();
+    QHash<QString, int> m_errors;
+    QElapsedTimer m_elapsed;
+    QTimer m_progress;
+    int m_enumerating = 0;
+    int m_inflight = 0;
+    int m_maxinflight = 0;
+    qint64 m_scanned = 0;
+    qint64 m_skipped = 0;
+    qint64 m_generated = 0;
+    qint64 m_adopted = 0;
+    qint64 m_failed = 0;
+};
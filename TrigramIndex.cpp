@@ -0,0 +1,137 @@
+#include "TrigramIndex.h"
+#include <algorithm>
+
+#include "ImageCatalog.h"
+
+namespace {
+quint64 trigramKey(QChar a, QChar b, QChar c) {
+    return (quint64(a.toLower().unicode()) << 32) | (quint64(b.toLower().unicode()) << 16) | c.toLower().unicode();
+}
+}
+
+void TrigramIndex::Postings::append(int idx) {
+    // The same trigram twice in one name
+    if (idx == last) {
+        return;
+    }
+    quint32 delta = quint32(idx - last);
+    while (delta >= 0x80) {
+        data.push_back(uchar(delta | 0x80));
+        delta >>= 7;
+    }
+    data.push_back(uchar(delta));
+    last = idx;
+    count++;
+}
+
+std::vector<int> TrigramIndex::Postings::decode() const {
+    std::vector<int> ids;
+    ids.reserve(count);
+    int id = -1;
+    quint32 delta = 0;
+    int shift = 0;
+    for (uchar b : data) {
+        delta |= quint32(b & 0x7f) << shift;
+        if (b & 0x80) {
+            shift += 7;
+            continue;
+        }
+        id += int(delta);
+        ids.push_back(id);
+        delta = 0;
+        shift = 0;
+    }
+    return ids;
+}
+
+void TrigramIndex::clear() {
+    m_names.clear();
+    m_dirs.clear();
+    m_indexeddirs = 0;
+}
+
+void TrigramIndex::addText(Index &index, QStringView text, int id) {
+    for (qsizetype i = 0; i + 2 < text.size(); ++i) {
+        index[trigramKey(text[i], text[i + 1], text[i + 2])].append(id);
+    }
+}
+
+void TrigramIndex::add(ImageCatalog const &catalog, int idx) {
+    addText(m_names, catalog.fileNameView(idx), idx);
+    // Folders are interned in order of first use
+    while (m_indexeddirs < catalog.dirCount()) {
+        addText(m_dirs, catalog.dir(m_indexeddirs), m_indexeddirs);
+        m_indexeddirs++;
+    }
+}
+
+bool TrigramIndex::matches(ImageCatalog const &catalog, int idx, QString const &query) {
+    return catalog.fileNameView(idx).contains(query, Qt::CaseInsensitive) ||
+           QStringView(catalog.dir(catalog.dirIndex(idx))).contains(query, Qt::CaseInsensitive);
+}
+
+std::vector<int> TrigramIndex::candidates(Index const &index, QStringView query) {
+    // The two rarest trigrams narrow it down the most, the rest is left to verification
+    std::vector<Postings const *> lists;
+    for (qsizetype i = 0; i + 2 < query.size(); ++i) {
+        auto const it = index.constFind(trigramKey(query[i], query[i + 1], query[i + 2]));
+        if (it == index.cend()) {
+            return {};
+        }
+        lists.push_back(&it.value());
+    }
+    std::sort(lists.begin(), lists.end(), [](Postings const *a, Postings const *b) { return a->count < b->count; });
+
+    std::vector<int> ids = lists.front()->decode();
+    if (lists.size() > 1 && lists[1] != lists[0]) {
+        std::vector<int> const other = lists[1]->decode();
+        std::vector<int> both;
+        std::set_intersection(ids.begin(), ids.end(), other.begin(), other.end(), std::back_inserter(both));
+        ids = std::move(both);
+    }
+    return ids;
+}
+
+std::vector<int> TrigramIndex::find(ImageCatalog const &catalog, QString const &query) const {
+    std::vector<int> result;
+    if (query.size() < 3) {
+        for (int idx = 0; idx < catalog.size(); ++idx) {
+            if (matches(catalog, idx, query)) {
+                result.push_back(idx);
+            }
+        }
+        return result;
+    }
+
+    std::vector<bool> dirmatch(catalog.dirCount(), false);
+    bool anydir = false;
+    for (int d : candidates(m_dirs, query)) {
+        if (QStringView(catalog.dir(d)).contains(query, Qt::CaseInsensitive)) {
+            dirmatch[d] = true;
+            anydir = true;
+        }
+    }
+
+    std::vector<int> const names = candidates(m_names, query);
+    if (!anydir) {
+        for (int idx : names) {
+            if (catalog.fileNameView(idx).contains(query, Qt::CaseInsensitive)) {
+                result.push_back(idx);
+            }
+        }
+        return result;
+    }
+
+    // Files of matching folders plus matching names, in catalog order
+    auto next = names.cbegin();
+    for (int idx = 0; idx < catalog.size(); ++idx) {
+        while (next != names.cend() && *next < idx) {
+            ++next;
+        }
+        if (dirmatch[catalog.dirIndex(idx)] ||
+            (next != names.cend() && *next == idx && catalog.fileNameView(idx).contains(query, Qt::CaseInsensitive))) {
+            result.push_back(idx);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <QHash>
+#include <QString>
+#include <QStringView>
+#include <vector>
+
+class ImageCatalog;
+
+// Case insensitive substring search over the file and folder names of an ImageCatalog.
+// Every file name is split into lower case trigrams, each with a posting list of catalog
+// indexes stored as delta varints (indexes only grow, so most deltas fit one byte). Folders
+// are indexed the same way by their interned folder index. A query intersects the two
+// rarest posting lists of its trigrams and verifies the survivors; queries shorter than a
+// trigram scan the packed names instead.
+class TrigramIndex {
+public:
+    void clear();
+    // Entries have to be added in catalog order
+    void add(ImageCatalog const &catalog, int idx);
+    std::vector<int> find(ImageCatalog const &catalog, QString const &query) const;
+    static bool matches(ImageCatalog const &catalog, int idx, QString const &query);
+
+private:
+    struct Postings {
+        std::vector<uchar> data;
+        int last = -1;
+        int count = 0;
+        void append(int idx);
+        std::vector<int> decode() const;
+    };
+    using Index = QHash<quint64, Postings>;
+
+    static void addText(Index &index, QStringView text, int id);
+    static std::vector<int> candidates(Index const &index, QStringView query);
+
+    Index m_names;
+    Index m_dirs;
+    int m_indexeddirs = 0;
+};
@@ -1,8 +1,12 @@
 #pragma once
 #include <QFileInfo>
 #include <QPointer>
+#include <QSize>
 #include <QString>
 
+#include "CancelToken.h"
+#include "ThumbLevel.h"
+
 struct WorkItem {
     QFileInfo fi;
     bool loadthumb = false;
@@ -10,4 +14,25 @@ struct WorkItem {
     bool destroyimage = false;
     QString m_error_message;
     QByteArray m_hash;
+    QByteArray m_fingerprint;
+    qint64 m_filesize = -1;
+    int m_idx = -1;
+    // Decode a scaled preview of at most this size before the full image, if the format can
+    QSize m_previewsize;
+    // Set by the loader for files with more than one frame
+    bool m_animated = false;
+    // The path key was looked up in the store and not found, the loader then tries the
+    // content fingerprint before generating a new thumbnail
+    bool m_keymissed = false;
+    // Thumbnail level the view wants, one of ThumbLevel::sizes
+    int m_level = ThumbLevel::base;
+    // Cancelled when the view that asked for it moved on to another folder or closed
+    CancelToken m_cancel;
+    // Set on the cover image of a folder that is not listed yet
+    QString m_folder;
+    // Thumbnail for where the viewport is heading, runs after everything visible
+    bool m_prefetch = false;
+    // Only known from the thumbnail database, as when browsing it: the file is never opened,
+    // it may be on a drive that is offline
+    bool m_storeonly = false;
 };
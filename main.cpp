@@ -1,3 +1,4 @@
+#include "Bench.h"
 #include "MainWindow.h"
 #include <QApplication>
 #include <QImageReader>
@@ -5,12 +6,14 @@
 
 
 int main(int argc, char *argv[]) {
+  Bench::start();
   QApplication app(argc, argv);
   app.setStyle(QStyleFactory::create(QStringLiteral(u"Fusion")));
 
   QCoreApplication::setOrganizationName(QStringLiteral("ImgView"));
   QCoreApplication::setApplicationName(QStringLiteral("ImgView"));
-  QImageReader::setAllocationLimit(1024 * 1024 * 1024);
+  // In megabytes: a single decoded image may take up to 1 GB
+  QImageReader::setAllocationLimit(1024);
 
   QStringList files = QCoreApplication::arguments();
   files.pop_front();